@@ -0,0 +1,223 @@
+#include "accesslog.h"
+
+/* Lines formatted by the writer, written out once per drain */
+typedef struct _access_batch {
+  FILE *out;
+  size_t used;
+  char buf[ACCESS_BATCH];
+} access_batch;
+
+static slot_registry rings = SLOT_REGISTRY_INIT(access_ring_t, ACCESS_LINE);
+static __thread slot_t *self;
+static FILE *log_out;
+static pthread_t writer;
+static int running;  /* Records go through the rings */
+static int stopping;
+static int pending;  /* Futex the writer sleeps on between drains */
+static access_batch log_batch, text_batch;
+
+/* The calling thread's ring, claimed or made on its first record */
+static access_ring_t *ring_self(void) {
+  return (access_ring_t *)(self ? self : slot_claim(&rings, &self));
+}
+
+/* The calling thread's ring, marked as being written, while the writer
+   runs. NULL once it has been told to stop, for records to go directly. */
+static access_ring_t *ring_enter(void) {
+  access_ring_t *r;
+  if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    return NULL;
+  r = ring_self();
+  /* Pairs with the exchange in accesslog_stop(): either it sees writing
+     set and waits, or this sees running cleared */
+  __atomic_store_n(&r->writing, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&running, __ATOMIC_SEQ_CST))
+    return r;
+  __atomic_store_n(&r->writing, 0, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static void ring_leave(access_ring_t *r) {
+  __atomic_store_n(&r->writing, 0, __ATOMIC_RELEASE);
+}
+
+static void copy_field(char *dst, const char *src, size_t size) {
+  size_t n = src ? strnlen(src, size - 1) : 0;
+  if (n > 0)
+    memcpy(dst, src, n);
+  dst[n] = '\0';
+}
+
+/* Formats rec as one line into buf, which holds at least size bytes */
+static size_t format_rec(char *buf, size_t size, const access_rec *rec) {
+  struct tm tm;
+  char when[24];
+  int n;
+  if (!rec->status[0]) {
+    n = snprintf(buf, size, "%s\n", rec->text);
+  } else {
+    gmtime_r(&rec->ts.tv_sec, &tm);
+    strftime(when, sizeof when, "%Y-%m-%dT%H:%M:%S", &tm);
+    n = snprintf(buf, size, "ts=%s.%06ldZ cid=%d addr=%s status=%s name=%s%s%s bytes=%llu us=%llu\n",
+      when, rec->ts.tv_nsec / 1000, rec->cid, rec->addr[0] ? rec->addr : "-",
+      rec->status, rec->text[0] ? "\"" : "-", rec->text, rec->text[0] ? "\"" : "",
+      (unsigned long long)rec->bytes, (unsigned long long)rec->us);
+  }
+  return n < 0 ? 0 : (size_t)n >= size ? size - 1 : (size_t)n;
+}
+
+static void batch_flush(access_batch *b) {
+  if (b->used == 0)
+    return;
+  fwrite(b->buf, 1, b->used, b->out);
+  fflush(b->out);
+  b->used = 0;
+}
+
+static void batch_add(access_batch *b, const access_rec *rec) {
+  if (ACCESS_BATCH - b->used < 2 * ACCESS_TEXT_LEN + 256)
+    batch_flush(b);
+  b->used += format_rec(b->buf + b->used, ACCESS_BATCH - b->used, rec);
+}
+
+/* Writes out everything the rings hold, oldest first within each thread */
+static void drain(void) {
+  access_ring_t *r;
+  slot_t *s;
+  uint64_t head, tail;
+  access_rec *rec;
+  for (s = slot_first(&rings); s; s = s->next) {
+    r = (access_ring_t *)s;
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    for (tail = r->tail; tail != head; ++tail) {
+      rec = &r->slot[tail % ACCESS_RING];
+      batch_add(rec->status[0] ? &log_batch : &text_batch, rec);
+    }
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+  }
+  batch_flush(&log_batch);
+  batch_flush(&text_batch);
+}
+
+static void *writer_thread(void *arg) {
+  struct timespec deadline;
+  int seen;
+  while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+    seen = __atomic_load_n(&pending, __ATOMIC_ACQUIRE);
+    drain();
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += ACCESS_FLUSH_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    futex_wait(&pending, seen, &deadline);
+  }
+  drain();
+  return NULL;
+}
+
+/* Writes rec from the calling thread, before the writer starts and after
+   it stops */
+static void write_direct(const access_rec *rec) {
+  char line[2 * ACCESS_TEXT_LEN + 256];
+  format_rec(line, sizeof line, rec);
+  fputs(line, rec->status[0] && log_out ? log_out : stderr);
+}
+
+/* Slot for the next record in r, NULL (and counted as dropped) when the
+   writer has fallen a whole ring behind */
+static access_rec *ring_reserve(access_ring_t *r) {
+  uint64_t head = r->head;
+  if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= ACCESS_RING) {
+    __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  return &r->slot[head % ACCESS_RING];
+}
+
+/* Publishes the slot ring_reserve() returned, waking the writer early once
+   the ring is half full */
+static void ring_commit(access_ring_t *r) {
+  uint64_t head = r->head + 1;
+  __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+  if (head - __atomic_load_n(&r->tail, __ATOMIC_RELAXED) == ACCESS_RING / 2) {
+    __atomic_add_fetch(&pending, 1, __ATOMIC_RELEASE);
+    futex_wake(&pending, 1);
+  }
+}
+
+/* Starts the writer, access records going to log and verbose lines to
+   stderr. Returns -1 with errno set if it could not be started. */
+int accesslog_start(FILE *log) {
+  log_out = log;
+  log_batch.out = log;
+  text_batch.out = stderr;
+  if ((errno = pthread_create(&writer, NULL, writer_thread, NULL)) != 0)
+    return -1;
+  __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Writes out what is left and stops the writer. Later records are written
+   directly. */
+void accesslog_stop(void) {
+  slot_t *s;
+  if (!__atomic_exchange_n(&running, 0, __ATOMIC_SEQ_CST))
+    return;
+  /* Records already on their way into a ring make the final drain */
+  for (s = slot_first(&rings); s; s = s->next)
+    while (__atomic_load_n(&((access_ring_t *)s)->writing, __ATOMIC_ACQUIRE))
+      sched_yield();
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&pending, 1, __ATOMIC_RELEASE);
+  futex_wake(&pending, 1);
+  pthread_join(writer, NULL);
+}
+
+void accesslog_add(const char *addr, int cid, const char *status,
+    const char *name, uint64_t bytes, uint64_t us) {
+  access_ring_t *r = ring_enter();
+  access_rec local, *rec = &local;
+  if (r && (rec = ring_reserve(r)) == NULL) {
+    ring_leave(r);
+    return;
+  }
+  clock_gettime(CLOCK_REALTIME, &rec->ts);
+  rec->bytes = bytes;
+  rec->us = us;
+  rec->cid = cid;
+  copy_field(rec->status, status, sizeof rec->status);
+  copy_field(rec->addr, addr, sizeof rec->addr);
+  copy_field(rec->text, name, sizeof rec->text);
+  if (r) {
+    ring_commit(r);
+    ring_leave(r);
+  } else {
+    write_direct(rec);
+  }
+}
+
+void accesslog_verbose(const char *format, va_list args) {
+  access_ring_t *r = ring_enter();
+  access_rec local, *rec = &local;
+  if (r && (rec = ring_reserve(r)) == NULL) {
+    ring_leave(r);
+    return;
+  }
+  rec->status[0] = '\0';
+  vsnprintf(rec->text, sizeof rec->text, format, args);
+  if (r) {
+    ring_commit(r);
+    ring_leave(r);
+  } else {
+    write_direct(rec);
+  }
+}
+
+/* Records lost to full rings so far */
+unsigned long accesslog_dropped(void) {
+  slot_t *s;
+  unsigned long n = 0;
+  for (s = slot_first(&rings); s; s = s->next)
+    n += __atomic_load_n(&((access_ring_t *)s)->dropped, __ATOMIC_RELAXED);
+  return n;
+}
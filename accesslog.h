@@ -0,0 +1,54 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>       /* sched_yield() */
+#include <netinet/in.h>  /* INET6_ADDRSTRLEN */
+#include "memory.h"
+#include "lfstack.h"     /* futex_wait() */
+#include "slots.h"
+
+#define ACCESS_LINE 64      /* Keeps the ends of a ring on separate cache lines */
+#define ACCESS_RING 256     /* Records per thread waiting for the writer */
+#define ACCESS_TEXT_LEN 160 /* Name, or a whole verbose line, truncated */
+#define ACCESS_FLUSH_MS 50  /* Longest a record waits for the writer */
+#define ACCESS_BATCH 65536  /* Bytes formatted per write */
+
+/* One line of the log. Access records carry a status, verbose lines only
+   the text. */
+typedef struct _access_rec {
+  struct timespec ts;  /* CLOCK_REALTIME */
+  uint64_t bytes;
+  uint64_t us;
+  int cid;
+  char status[12];     /* Empty for verbose lines */
+  char addr[INET6_ADDRSTRLEN];
+  char text[ACCESS_TEXT_LEN];
+} access_rec;
+
+/* Single producer, single consumer ring of one thread's records, kept in
+   a slot registry so the writer never has to tell a finished ring from an
+   idle one */
+typedef struct _access_ring {
+  slot_t reg;
+  uint64_t head;       /* Next record to fill, written by the owner */
+  int writing;         /* The owner is between checking running and committing */
+  char pad1[ACCESS_LINE - sizeof(slot_t) - sizeof(uint64_t) - sizeof(int)];
+  uint64_t tail;       /* Next record to drain, written by the writer */
+  char pad2[ACCESS_LINE - sizeof(uint64_t)];
+  unsigned long dropped;
+  access_rec slot[ACCESS_RING];
+} access_ring_t;
+
+int accesslog_start(FILE *log);
+void accesslog_stop(void);
+void accesslog_add(const char *addr, int cid, const char *status,
+  const char *name, uint64_t bytes, uint64_t us);
+void accesslog_verbose(const char *format, va_list args);
+unsigned long accesslog_dropped(void);
+
+#endif
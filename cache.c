@@ -0,0 +1,368 @@
+#include "cache.h"
+
+/* Byte-budgeted LRU cache of whole image files. Concurrent misses on the
+   same path are coalesced: the first thread loads, the others wait on
+   c->loaded and share its result. With CACHE_NOWAIT a miss is queued for
+   the loader thread instead and the caller goes to disk meanwhile. Every
+   hit re-stats the file and drops the entry if it changed, so what is
+   served (and the validator built from e->mtime) never outlives the file
+   on disk. CACHE_NOSTAT leaves that stat to the caller, who reports it
+   with cache_check(). */
+
+static unsigned long hash_key(const char *s) {
+  unsigned long h = 2166136261UL; /* FNV-1a */
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+static void *loader_thread(void *arg);
+
+/* Caches files relative to dirfd in budget bytes. Returns -1 with errno
+   set if the loader thread could not be started. */
+int cache_init(cache_t *c, size_t budget, int dirfd) {
+  memset(c, 0, sizeof(cache_t));
+  c->budget = budget;
+  c->dirfd = dirfd;
+  pthread_cond_init(&(c->loaded), NULL);
+  pthread_cond_init(&(c->queued), NULL);
+  pthread_mutex_init(&(c->lock), NULL);
+  LOCK_NAME(&(c->lock), "cache.lock");
+  if ((errno = pthread_create(&c->loader, NULL, loader_thread, c)) != 0)
+    return -1;
+  pthread_detach(c->loader);
+  return 0;
+}
+
+/* BEGIN NEED c->lock */
+static cache_entry *lookup(cache_t *c, const char *key, unsigned long h) {
+  cache_entry *e;
+  for (e = c->buckets[h % CACHE_BUCKETS]; e; e = e->hnext) {
+    if (strcmp(e->key, key) == 0)
+      return e;
+  }
+  return NULL;
+}
+
+static void lru_unlink(cache_t *c, cache_entry *e) {
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    c->head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    c->tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void lru_push(cache_t *c, cache_entry *e) {
+  e->prev = NULL;
+  e->next = c->head;
+  if (c->head)
+    c->head->prev = e;
+  c->head = e;
+  if (!c->tail)
+    c->tail = e;
+}
+
+static void unhash(cache_t *c, cache_entry *e) {
+  cache_entry **p = &(c->buckets[hash_key(e->key) % CACHE_BUCKETS]);
+  while (*p != e)
+    p = &((*p)->hnext);
+  *p = e->hnext;
+}
+
+/* Takes e out of the table and the LRU list */
+static void detach(cache_t *c, cache_entry *e) {
+  unhash(c, e);
+  lru_unlink(c, e);
+  c->bytes -= e->size;
+  --c->entries;
+  e->stale = 1;
+}
+
+static void destroy(cache_entry *e) {
+  if (e->data)
+    efree(e->data);
+  efree(e->key);
+  efree(e);
+}
+
+static void evict(cache_t *c) {
+  cache_entry *e = c->tail, *prev;
+  while (e && c->bytes > c->budget) {
+    prev = e->prev;
+    if (e->state != CE_LOADING && e->refs == 0) {
+      detach(c, e);
+      destroy(e);
+      ++c->evictions;
+    }
+    e = prev;
+  }
+}
+
+/* Publishes the outcome r of load() on e, keeping the loader's reference
+   only if it succeeded (r == 0), and wakes coalesced waiters */
+static void loaded(cache_t *c, cache_entry *e, int r) {
+  if (r <= 0) {
+    /* Too large files stay, with no data, to send later requests
+       straight to disk */
+    e->state = r == 0 ? CE_READY : CE_DISK;
+    lru_push(c, e);
+    c->bytes += e->size;
+    ++c->entries;
+    if (r == 0)
+      evict(c);
+    else
+      --e->refs;
+  } else {
+    /* Failed entries leave the table now, waiters free them */
+    unhash(c, e);
+    e->err = r;
+    if (--e->refs == 0) {
+      efree(e->key);
+      efree(e);
+    }
+  }
+  pthread_cond_broadcast(&(c->loaded));
+}
+/* END need c->lock */
+
+/* Reads all of path into e->data. Returns 0, an errno value, or -1 if the
+   file exists but should be served from disk instead, in which case it is
+   left open in *fdp with its fstat in *st. */
+static int load(cache_t *c, cache_entry *e, int dirfd, const char *path,
+    int *fdp, struct stat *st) {
+  size_t got = 0;
+  ssize_t r;
+  int fd, err;
+  if ((fd = openat(dirfd, path, O_RDONLY)) == -1)
+    return errno;
+  if (fstat(fd, st) == -1) {
+    err = errno;
+    close(fd);
+    return err;
+  }
+  if (!S_ISREG(st->st_mode) || (size_t)st->st_size > c->budget / CACHE_ENTRY_DIV) {
+    *fdp = fd;
+    return -1;
+  }
+  e->data = (char *)emalloc(st->st_size > 0 ? st->st_size : 1);
+  while (got < (size_t)st->st_size) {
+    r = read(fd, e->data + got, st->st_size - got);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0) {
+      err = r == 0 ? EIO : errno;
+      close(fd);
+      efree(e->data);
+      e->data = NULL;
+      return err;
+    }
+    got += r;
+  }
+  close(fd);
+  e->size = got;
+  e->mtime = st->st_mtim;
+  e->ino = st->st_ino;
+  return 0;
+}
+
+static int same_file(cache_entry *e, const struct stat *st) {
+  return st->st_ino == e->ino && (size_t)st->st_size == e->size &&
+    st->st_mtim.tv_sec == e->mtime.tv_sec && st->st_mtim.tv_nsec == e->mtime.tv_nsec;
+}
+
+/* Whether path still is the file e was loaded from. Returns 1, 0 if it
+   changed, or -1 with errno set if it cannot be stat'd. */
+static int unchanged(cache_entry *e, int dirfd, const char *path) {
+  struct stat st;
+  if (fstatat(dirfd, path, &st, 0) == -1)
+    return -1;
+  return same_file(e, &st);
+}
+
+/* BEGIN NEED c->lock */
+/* Counts a checked hit on e, or drops e from the table if it changed */
+static int checked(cache_t *c, cache_entry *e, int r) {
+  if (r == 1) {
+    ++c->hits;
+    if (!e->stale) {
+      lru_unlink(c, e);
+      lru_push(c, e);
+    }
+    return 1;
+  }
+  if (!e->stale) {
+    detach(c, e);
+    ++c->invalidations;
+  }
+  return 0;
+}
+/* END need c->lock */
+
+/* Returns a referenced entry holding the contents of path (relative to
+   dirfd), to be handed back with cache_release(). Otherwise returns NULL
+   with *err set if the file cannot be opened, or with *err = 0 if the
+   caller should go to disk. A file found to be too large on this call is
+   handed over open in *fd, with its fstat in *st; *fd is -1 when the
+   caller has to open it itself. */
+cache_entry *cache_get(cache_t *c, const char *path, int flags, int *fd,
+    struct stat *st, int *err) {
+  unsigned long h = hash_key(path);
+  cache_entry *e;
+  int r;
+  *err = 0;
+  *fd = -1;
+  pthread_mutex_lock(&(c->lock));
+  while ((e = lookup(c, path, h)) != NULL && e->state == CE_READY) {
+    ++e->refs;
+    if (flags & CACHE_NOSTAT) {
+      pthread_mutex_unlock(&(c->lock));
+      return e;
+    }
+    pthread_mutex_unlock(&(c->lock));
+    r = unchanged(e, c->dirfd, path);
+    *err = r == -1 ? errno : 0;
+    pthread_mutex_lock(&(c->lock));
+    if (checked(c, e, r)) {
+      pthread_mutex_unlock(&(c->lock));
+      return e;
+    }
+    /* Changed or gone: drop it and look again, another thread may be
+       reloading it already */
+    if (--e->refs == 0)
+      destroy(e);
+    if (r == -1) {
+      pthread_mutex_unlock(&(c->lock));
+      return NULL;
+    }
+  }
+  if (e && e->state == CE_DISK) {
+    /* Known too large, so not even opened here */
+    ++c->uncacheable;
+    pthread_mutex_unlock(&(c->lock));
+    return NULL;
+  }
+  if (e && (flags & CACHE_NOWAIT)) {
+    ++c->misses;
+    ++c->deferred;
+    pthread_mutex_unlock(&(c->lock));
+    return NULL;
+  }
+  if (e) {
+    ++e->refs;
+    ++c->misses;
+    ++c->coalesced;
+    while (e->state == CE_LOADING && e->err == 0)
+      pthread_cond_wait(&(c->loaded), &(c->lock));
+    if (e->state == CE_READY) {
+      /* Freshly loaded, so not re-stat'd */
+      pthread_mutex_unlock(&(c->lock));
+      return e;
+    }
+    /* Load failed or found the file too large, last one out cleans up */
+    *err = e->err > 0 ? e->err : 0;
+    if (--e->refs == 0 && e->state == CE_LOADING) {
+      efree(e->key);
+      efree(e);
+    }
+    pthread_mutex_unlock(&(c->lock));
+    return NULL;
+  }
+  e = ALLOC(cache_entry);
+  e->key = estrdup(path);
+  e->data = NULL;
+  e->size = 0;
+  e->state = CE_LOADING;
+  e->refs = 1;
+  e->stale = 0;
+  e->err = 0;
+  e->prev = e->next = NULL;
+  e->hnext = c->buckets[h % CACHE_BUCKETS];
+  c->buckets[h % CACHE_BUCKETS] = e;
+  ++c->misses;
+  if (flags & CACHE_NOWAIT) {
+    /* The loader holds the reference from here */
+    ++c->deferred;
+    e->qnext = NULL;
+    if (c->queue_tail)
+      c->queue_tail->qnext = e;
+    else
+      c->queue = e;
+    c->queue_tail = e;
+    pthread_cond_signal(&(c->queued));
+    pthread_mutex_unlock(&(c->lock));
+    return NULL;
+  }
+  pthread_mutex_unlock(&(c->lock));
+  
+  r = load(c, e, c->dirfd, path, fd, st);
+  
+  pthread_mutex_lock(&(c->lock));
+  if (r == -1) {
+    --c->misses;
+    ++c->uncacheable;
+  }
+  loaded(c, e, r);
+  pthread_mutex_unlock(&(c->lock));
+  *err = r > 0 ? r : 0;
+  return r == 0 ? e : NULL;
+}
+
+/* Loads what CACHE_NOWAIT callers queued, one file at a time */
+static void *loader_thread(void *arg) {
+  cache_t *c = (cache_t *)arg;
+  cache_entry *e;
+  struct stat st;
+  int r, fd;
+  pthread_mutex_lock(&(c->lock));
+  for (;;) {
+    while (!c->queue)
+      pthread_cond_wait(&(c->queued), &(c->lock));
+    e = c->queue;
+    if ((c->queue = e->qnext) == NULL)
+      c->queue_tail = NULL;
+    pthread_mutex_unlock(&(c->lock));
+    fd = -1;
+    r = load(c, e, c->dirfd, e->key, &fd, &st);
+    if (fd != -1)
+      close(fd);
+    pthread_mutex_lock(&(c->lock));
+    loaded(c, e, r);
+    if (r == 0 && --e->refs == 0 && c->bytes > c->budget)
+      evict(c);
+  }
+  return NULL;
+}
+
+/* Checks a hit handed over by CACHE_NOSTAT against st, the caller's stat
+   of its path, or NULL if that failed. Returns 1 if e can be served;
+   otherwise e is dropped from the table and must still be released. */
+int cache_check(cache_t *c, cache_entry *e, const struct stat *st) {
+  int r;
+  pthread_mutex_lock(&(c->lock));
+  r = checked(c, e, st ? same_file(e, st) : -1);
+  pthread_mutex_unlock(&(c->lock));
+  return r;
+}
+
+void cache_release(cache_t *c, cache_entry *e) {
+  pthread_mutex_lock(&(c->lock));
+  if (--e->refs == 0 && e->stale)
+    destroy(e);
+  else if (c->bytes > c->budget)
+    evict(c);
+  pthread_mutex_unlock(&(c->lock));
+}
+
+void cache_stats(cache_t *c, FILE *out) {
+  pthread_mutex_lock(&(c->lock));
+  fprintf(out, "Cache: %lu hits, %lu misses (%lu coalesced, %lu deferred), %lu uncacheable, %lu evictions, %lu invalidations, %ld/%ld bytes in %d entries\n",
+    c->hits, c->misses, c->coalesced, c->deferred, c->uncacheable, c->evictions, c->invalidations,
+    (long)c->bytes, (long)c->budget, c->entries);
+  pthread_mutex_unlock(&(c->lock));
+}
@@ -0,0 +1,69 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "memory.h"
+
+#define CACHE_BUCKETS 1024
+#define CACHE_ENTRY_DIV 4 /* Largest cacheable file is budget/CACHE_ENTRY_DIV */
+
+#define CE_LOADING 0
+#define CE_READY 1
+#define CE_DISK 2   /* Too large or not a regular file, served from disk */
+
+#define CACHE_NOWAIT 1 /* Never read or wait on a load, for event loop threads */
+#define CACHE_NOSTAT 2 /* Hand hits over unchecked, see cache_check() */
+
+typedef struct _cache_entry {
+  char *key;
+  char *data;
+  size_t size;           /* Of data, 0 for CE_DISK */
+  struct timespec mtime; /* Of the file as it was loaded */
+  ino_t ino;
+  int state;
+  int refs;       /* Readers currently holding data, never evicted while > 0 */
+  int stale;      /* Out of the table, freed by the last cache_release() */
+  struct _cache_entry *qnext; /* Queued for the loader */
+  int err;        /* errno of a failed load, handed to coalesced waiters */
+  struct _cache_entry *hnext; /* Hash chain */
+  struct _cache_entry *prev;  /* LRU list, head is most recent */
+  struct _cache_entry *next;
+} cache_entry;
+
+typedef struct _cache {
+  cache_entry *buckets[CACHE_BUCKETS];
+  cache_entry *head;
+  cache_entry *tail;
+  size_t bytes;
+  size_t budget;
+  int entries;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long coalesced; /* Of the misses, those that waited on another thread's load */
+  unsigned long deferred;  /* Of the misses, those sent to disk while the loader reads the file */
+  unsigned long evictions;
+  unsigned long invalidations; /* Hits on files changed since they were loaded */
+  unsigned long uncacheable; /* Requests sent to disk by a CE_DISK entry, not misses */
+  int dirfd;
+  cache_entry *queue;     /* Loads asked for with CACHE_NOWAIT, oldest first */
+  cache_entry *queue_tail;
+  pthread_t loader;
+  pthread_mutex_t lock;
+  pthread_cond_t loaded;
+  pthread_cond_t queued;
+} cache_t;
+
+int cache_init(cache_t *c, size_t budget, int dirfd);
+cache_entry *cache_get(cache_t *c, const char *path, int flags, int *fd,
+  struct stat *st, int *err);
+int cache_check(cache_t *c, cache_entry *e, const struct stat *st);
+void cache_release(cache_t *c, cache_entry *e);
+void cache_stats(cache_t *c, FILE *out);
+
+#endif
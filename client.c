@@ -8,8 +8,16 @@ static int sockfd;
 static int adaptivefd;
 static int verbose_f;
 static int adaptive_f;
+static int inband_f; /* Speed updates go over sockfd as SPEED lines */
 static int batch_f;
 static readbuffer *buffer;
+static arena_t arena; /* Per response, reset once it is handled */
+static FILE *profile_out; /* stderr from before --silent */
+static char *outdir; /* NULL when not writing to the filesystem */
+static int resume_f;
+static int store_f;
+static stored *store[STORE_BUCKETS];
+static FILE *manifest;
 
 /**
  Misc. Helper Functions
@@ -102,33 +110,16 @@ int connect_to_host(char *host, int port, char* buffer, int buflen) {
 }
 
 static size_t trim_in_place(char *string) {
-  int start, end;
-  size_t len;
-  char *buffer;
-  char *p = string;
+  size_t start, end;
   start = 0;
-  while (isspace(*p)) {
+  while (isspace(string[start]))
     ++start;
-    ++p;
-  }
-  if (*p == '\0') { // All spaces?
-    *string = '\0'; // Empty string that shit
-    return 0;
-  }
-  end = strlen(string) - 1;
-  p = string + end;
-  while (p > string && isspace(*p)) {
+  end = start + strlen(string + start);
+  while (end > start && isspace(string[end - 1]))
     --end;
-    --p;
-  }
-  ++end; /* we went too far */
-  len = end-start;
-  buffer = (char *)emalloc(len+1); /* room for null char */
-  memcpy(buffer, (string + start), len);
-  buffer[len] = '\0';
-  memcpy(string, buffer, len+1);
-  efree(buffer);
-  return len;
+  memmove(string, string + start, end - start);
+  string[end - start] = '\0';
+  return end - start;
 }
 
 static int add_newline(char *buffer, int maxlen) {
@@ -167,6 +158,7 @@ static void global_exit(int status) {
     close(sockfd);
   if (adaptive_f && adaptivefd != -1)
     close(adaptivefd);
+  mem_profile_dump(profile_out);
   exit(status);
 }
 
@@ -190,7 +182,7 @@ static char *recvline() {
     if (end) { /* Found a newline */
       *end = '\0'; /* Replace newline with null to return */
       r = end - start;
-      line = estrndup(start, r);
+      line = arena_strndup(&arena, start, r);
       buffer->used -= r + 1;
       start = end + 1;
       memmove(buffer->data, start, buffer->used);
@@ -215,6 +207,210 @@ static char *recvline() {
   }
 }
 
+/* Parses the next numeric field of a response line */
+static size_t next_size(void) {
+  char *t = strtok(NULL,DELIM);
+  size_t n;
+  errno = 0;
+  n = t ? (size_t)strtol(t,NULL,0) : 0;
+  if (!t || errno == ERANGE) {
+    fprintf(stderr,"Fatal Error: Could not parse file size.\n");
+    global_exit(0);
+  }
+  return n;
+}
+
+/* Size of the copy of name in outdir, -1 if there is none */
+static off_t partial_size(const char *name) {
+  char filename[LINE_SIZE * 2];
+  struct stat st;
+  snprintf(filename, sizeof filename, "%s/%s", outdir, name);
+  if (stat(filename, &st) == -1 || !S_ISREG(st.st_mode))
+    return -1;
+  return st.st_size;
+}
+
+/**
+  Local Store
+  Maps the names in outdir to the validator of the version they hold. The
+  manifest is appended to as versions change and replayed on startup.
+*/
+static unsigned long store_hash(const char *s) {
+  unsigned long h = 2166136261UL; /* FNV-1a */
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619UL;
+  }
+  return h % STORE_BUCKETS;
+}
+
+/* The validator stored for name, NULL if unknown */
+static const char *store_get(const char *name) {
+  stored *e;
+  for (e = store[store_hash(name)]; e; e = e->next) {
+    if (strcmp(e->name, name) == 0)
+      return strcmp(e->validator, "-") == 0 ? NULL : e->validator;
+  }
+  return NULL;
+}
+
+/* Records that name now holds the version described by validator */
+static void store_set(const char *name, const char *validator, int persist) {
+  stored *e;
+  unsigned long h = store_hash(name);
+  for (e = store[h]; e; e = e->next) {
+    if (strcmp(e->name, name) == 0)
+      break;
+  }
+  if (e && strcmp(e->validator, validator) == 0)
+    return;
+  if (!e) {
+    e = ALLOC(stored);
+    e->name = estrndup(name, strlen(name));
+    e->next = store[h];
+    store[h] = e;
+  }
+  snprintf(e->validator, VALIDATOR_LEN, "%s", validator);
+  if (persist && manifest) {
+    fprintf(manifest, "%s %s\n", e->validator, e->name);
+    fflush(manifest);
+  }
+}
+
+static void store_open(const char *dir) {
+  char path[LINE_SIZE * 2], line[LINE_SIZE + VALIDATOR_LEN], *name;
+  FILE *f;
+  snprintf(path, sizeof path, "%s/%s", dir, STORE_MANIFEST);
+  if ((f = fopen(path, "r")) != NULL) {
+    while (fgets(line, sizeof line, f)) {
+      remove_newline(line);
+      if ((name = strchr(line, ' ')) == NULL)
+        continue;
+      *name++ = '\0';
+      store_set(name, line, 0);
+    }
+    fclose(f);
+  }
+  if ((manifest = fopen(path, "a")) == NULL)
+    perror("fopen");
+}
+
+/* Size of the file a validator describes, which is its leading field */
+static off_t validator_size(const char *validator) {
+  return (off_t)strtoll(validator, NULL, 16);
+}
+
+/* Reads the server's response to the request for name, saving the file
+   into outdir unless it is NULL. With pipelined requests the read buffer
+   may already hold later responses, so only this file's bytes are taken.
+   Responses to a BATCH carry the name they answer as a trailing field,
+   and a PART response is written at its offset into the existing file.
+   SAME means the stored copy is current and nothing follows, and the
+   metrics answering STATS go to stdout. */
+static void recv_response(const char *name) {
+  char *t, *line, *filename, *filebuf;
+  FILE *file;
+  size_t filesize, read, remain, total, chunk, offset = 0;
+  int l, part;
+  line = recvline();
+  t = strtok(line,DELIM);
+  if (strcmp(t, "ERROR") == 0){
+    t = strtok(NULL,DELIM);
+    fprintf(stderr, "Server> Error: %s\n", t);
+    if ((t = strtok(NULL,DELIM)) && strcmp(t, name) != 0)
+      verbose("Error answers '%s', expected '%s'\n", t, name);
+  } else if (strcmp(t, "SAME") == 0) {
+    printf("'%s' unchanged.\n", name);
+  } else if ((part = strcmp(t, "PART") == 0) || strcmp(t, "FILE") == 0) {
+    if (part) {
+      offset = next_size();
+      filesize = next_size();
+      next_size(); /* Total size */
+    } else {
+      filesize = next_size();
+    }
+    if ((t = strtok(NULL,DELIM)) && store_f)
+      store_set(name, t, 1);
+    if ((t = strtok(NULL,DELIM)) && strcmp(t, name) != 0)
+      verbose("File answers '%s', expected '%s'\n", t, name);
+    if (outdir) {
+      l = snprintf(NULL, 0, "%s/%s", outdir, name);
+      filename = (char *)arena_alloc(&arena, l+1);
+      snprintf(filename, l+1, "%s/%s", outdir, name);
+    } else {
+      filename = (char *)arena_alloc(&arena, 10);
+      snprintf(filename, 10, "/dev/null");
+    }
+    file = NULL;
+    if (part && outdir && (file = fopen(filename,"r+b")) != NULL) {
+      fseeko(file, offset, SEEK_SET);
+      verbose("Resuming '%s' at %ld\n", name, (long)offset);
+    }
+    if (!file)
+      file = fopen(filename,"wb");
+    chunk = (filesize > MAX_FILE_BUFFER) ? MAX_FILE_BUFFER : filesize;
+    filebuf = (char *)arena_alloc(&arena, chunk);
+    remain = filesize;
+    total = 0;
+    if (buffer->used > 0){
+      read = buffer->used > remain ? remain : buffer->used;
+      fwrite(buffer->data, 1, read, file);
+      total += read;
+      remain -= read;
+      buffer->used -= read;
+      memmove(buffer->data, buffer->data + read, buffer->used);
+    }
+    fprintf(stderr,"'%s' [%ld/%ld]", name, (long)total, (long)filesize);
+    while (remain > 0) {
+      read = recv(sockfd, filebuf, remain < chunk ? remain : chunk, 0);
+      if (read == -1) {
+        perror("recv");
+        global_exit(3);
+      } else if (read == 0) {
+        fprintf(stderr,"Server dropped connection.\n");
+        global_exit(4);
+      }
+      total += read;
+      remain -= read;
+      fprintf(stderr,"%c[2K\r", 27);
+      fprintf(stderr,"'%s' [%ld/%ld] (%ld%%)", name, (long)total, (long)filesize, (long)(100*total)/filesize);
+      fwrite(filebuf, 1, read, file);
+    }
+    fprintf(stderr,"%c[2K\r", 27);
+    if (part)
+      printf("'%s' resumed. [%ld/%ld from %ld]\n", name, (long)total, (long)filesize, (long)offset);
+    else
+      printf("'%s' saved. [%ld/%ld]\n", name, (long)total, (long)filesize);
+    fclose(file);
+  } else if (strcmp(t, "STATS") == 0) {
+    /* Server metrics, printed rather than saved */
+    remain = next_size();
+    filebuf = (char *)arena_alloc(&arena, MAX_FILE_BUFFER);
+    while (remain > 0) {
+      if (buffer->used > 0) {
+        read = buffer->used > remain ? remain : buffer->used;
+        memcpy(filebuf, buffer->data, read);
+        buffer->used -= read;
+        memmove(buffer->data, buffer->data + read, buffer->used);
+      } else {
+        read = recv(sockfd, filebuf, remain < MAX_FILE_BUFFER ? remain : MAX_FILE_BUFFER, 0);
+        if (read == -1) {
+          perror("recv");
+          global_exit(3);
+        } else if (read == 0) {
+          fprintf(stderr,"Server dropped connection.\n");
+          global_exit(4);
+        }
+      }
+      fwrite(filebuf, 1, read, stdout);
+      remain -= read;
+    }
+  } else {
+    verbose("Ignoring unexpected message from server: %s\n", t);
+  }
+  arena_reset(&arena);
+}
+
 #ifdef HAS_GNUREADLINE
 char *snreadline(char *buffer, size_t length, char *prompt) {
   char *line;
@@ -250,13 +446,15 @@ static struct argp_option options[] = {
   {"batch",     'b', 0, 0, "Runs in batch mode, implies silent" },
   {"file",      'f', "FILE", 0, "Reads commands from FILE. Implies batch. Fails silently on bad argument." },
   {"nooutput",  'n', 0, 0, "Prevents writing to the filesystem" },
+  {"resume",    'r', "DIR", 0, "Stores images in DIR, resuming partially downloaded files" },
+  {"cache",     'c', "DIR", 0, "Stores images in DIR, only downloading those that changed" },
   { 0 }
 };
 
 struct arguments {
   int port;     /* arg1 */
   int adaptive, verbose, silent, batch, devnull;   /* '-a', '-v', '-m' */
-  char *host, *infile;   /* arg2 */
+  char *host, *infile, *resume, *store;   /* arg2 */
 };
 
 static error_t parse_opt (int key, char *arg, struct argp_state *state) {
@@ -286,6 +484,12 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
   case 'n':
     arguments->devnull = 1;
     break;
+  case 'r':
+    arguments->resume = arg;
+    break;
+  case 'c':
+    arguments->store = arg;
+    break;
 
   case ARGP_KEY_ARG:
     if (state->arg_num == 0) {
@@ -305,6 +509,11 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
     if (state->arg_num < 2)
       /* Not enough arguments */
       argp_usage(state);
+    if ((arguments->resume || arguments->store) && arguments->devnull)
+      argp_error(state, "--resume and --cache need an output directory");
+    if (arguments->resume && arguments->store &&
+        strcmp(arguments->resume, arguments->store) != 0)
+      argp_error(state, "--resume and --cache must share a directory");
     break;
 
   default:
@@ -329,13 +538,25 @@ int main(int argc, char **argv) {
   arguments.batch = 0;
   arguments.devnull = 0;
   arguments.infile = NULL;
+  arguments.resume = NULL;
+  arguments.store = NULL;
   
   argp_parse (&argp, argc, argv, 0, 0, &arguments);
   
   verbose_f = 0;
   if (arguments.verbose)
     verbose_f = 1;
+  profile_out = stderr;
   if (arguments.silent) {
+#ifdef MEM_PROFILE
+    int fd = dup(2);
+    if (fd == -1 || (profile_out = fdopen(fd, "w")) == NULL) {
+      perror("profile"); /* Falls back to the silenced stderr */
+      if (fd != -1)
+        close(fd);
+      profile_out = stderr;
+    }
+#endif
     freopen("/dev/null", "w", stderr);
     freopen("/dev/null", "w", stdout);
   }
@@ -354,10 +575,13 @@ int main(int argc, char **argv) {
   
   char foldertmp[] = "clientimgXXXXXX";
   char s[INET6_ADDRSTRLEN], *t, *line, linebuf[LINE_SIZE];
-  char *filename, *filebuf;
+  char pending[PIPELINE_DEPTH][LINE_SIZE]; /* Requests awaiting a response */
+  char names[PIPELINE_DEPTH * (LINE_SIZE + 48 + VALIDATOR_LEN)], batchhdr[32];
+  const char *v;
   int cid, l; /* Return values, temp values */
-  FILE *file;
-  size_t filesize, read, remain, total, chunk;
+  int depth, head = 0, inflight = 0, eof = 0, n;
+  off_t have;
+  size_t len;
   
   sockfd = connect_to_host(arguments.host, arguments.port, s, sizeof s);
   if (sockfd == -1) {
@@ -368,6 +592,7 @@ int main(int argc, char **argv) {
   
   buffer = ALLOC(readbuffer);
   buffer->used = 0;
+  arena_init(&arena, MAX_FILE_BUFFER + 2 * LINE_SIZE);
   
   // HELLO YES THIS IS SERVER
   line = recvline();
@@ -394,6 +619,16 @@ int main(int argc, char **argv) {
       fprintf(stderr, "Invalid port number from server. Exiting");
       global_exit(1);
     }
+    if ((t = strtok(NULL,DELIM)) != NULL && strcmp(t, "SPEED") == 0)
+      inband_f = 1;
+  }
+  if (inband_f) {
+    /* Register at the lowest speed, as the adaptive port handshake does */
+    if (send(sockfd, "SPEED:1\n", 8, 0) == -1){
+      perror("send");
+      global_exit(1);
+    }
+  } else if (adaptive_f) {
     adaptivefd = connect_to_host(arguments.host, l, NULL, 0);
     if (adaptivefd == -1) {
       fprintf(stderr, "failed to connect to adaptive server.\n");
@@ -405,102 +640,105 @@ int main(int argc, char **argv) {
       global_exit(1);
     }
   }
-  efree(line);
-  if (!arguments.devnull){
+  arena_reset(&arena);
+  outdir = NULL;
+  if (arguments.resume || arguments.store) {
+    outdir = arguments.resume ? arguments.resume : arguments.store;
+    if (mkdir(outdir, 0755) == -1 && errno != EEXIST) {
+      perror("mkdir");
+      global_exit(1);
+    }
+    resume_f = arguments.resume != NULL;
+    store_f = arguments.store != NULL;
+    if (store_f)
+      store_open(outdir);
+    fprintf(stdout, "Keeping downloads in directory %s.\n", outdir);
+  } else if (!arguments.devnull){
     mkdtemp(foldertmp);
+    outdir = foldertmp;
     fprintf(stdout, "Storing downloaded images in directory %s.\n", foldertmp);
   }
   
+  /* Batch mode pipelines up to PIPELINE_DEPTH requests. Once half the
+     window has drained, the free slots are refilled with a single BATCH
+     so the server can stream the records back to back. */
+  depth = batch_f ? PIPELINE_DEPTH : 1;
   for (;;) {
-#ifdef HAS_GNUREADLINE
-    if(snreadline(linebuf, LINE_SIZE, "GET> ") == NULL){
-#else
-    if (!batch_f)
-      fprintf(stderr, "GET> ");
-    if(fgets(linebuf, LINE_SIZE, stdin) == NULL){
-#endif
+    if (inflight > 0 && (eof || inflight > depth / 2)) {
+      recv_response(pending[head]);
+      head = (head + 1) % depth;
+      --inflight;
+      continue;
+    }
+    if (eof) {
       printf("exit\n");
       global_exit(0);
     }
+    n = 0;
+    len = 0;
+    while (!eof && inflight + n < depth) {
+#ifdef HAS_GNUREADLINE
+      if(snreadline(linebuf, LINE_SIZE, "GET> ") == NULL){
+#else
+      if (!batch_f)
+        fprintf(stderr, "GET> ");
+      if(fgets(linebuf, LINE_SIZE, stdin) == NULL){
+#endif
+        eof = 1;
+        break;
+      }
 #ifndef HAS_GNUREADLINE
-    trim_in_place(linebuf);
+      trim_in_place(linebuf);
 #endif
-    if (strlen(linebuf) == 0) continue;
-    /* Hacky hack to transmit panning speed, any 2 or less digit
-       number is considered a pan speed */
-    if (adaptive_f && strlen(linebuf) < 3 && is_number(linebuf)) {
-      add_newline(linebuf, LINE_SIZE);
-      if (send(adaptivefd, linebuf, strlen(linebuf), 0) == -1){
+      if (strlen(linebuf) == 0) continue;
+      /* Hacky hack to transmit panning speed, any 2 or less digit
+         number is considered a pan speed */
+      if (adaptive_f && strlen(linebuf) < 3 && is_number(linebuf)) {
+        if (inband_f) {
+          snprintf(batchhdr, sizeof batchhdr, "SPEED:%s", linebuf);
+          strcpy(linebuf, batchhdr);
+        }
+        add_newline(linebuf, LINE_SIZE);
+        if (send(inband_f ? sockfd : adaptivefd, linebuf, strlen(linebuf), 0) == -1){
+          perror("send");
+          global_exit(1);
+        }
+        continue;
+      }
+      if (add_newline(linebuf, LINE_SIZE)) {
+        fprintf(stderr, "Command too long.\n");
+        continue;
+      }
+      remove_newline(linebuf);
+      /* Ask only for what changed or is missing since an earlier run.
+         The server only sends validators to conditional requests, so
+         names with none stored yet go out as IF:-: */
+      have = outdir ? partial_size(linebuf) : -1;
+      v = store_f ? store_get(linebuf) : NULL;
+      if (v && have == validator_size(v))
+        len += sprintf(names + len, "IF:%s:%s\n", v, linebuf);
+      else if (v && resume_f && have > 0 && have < validator_size(v))
+        len += sprintf(names + len, "IF:%s:RANGE:%ld:0:%s\n", v, (long)have, linebuf);
+      else if (resume_f && have > 0)
+        len += sprintf(names + len, "%sRANGE:%ld:0:%s\n", store_f ? "IF:-:" : "",
+          (long)have, linebuf);
+      else
+        len += sprintf(names + len, "%s%s\n", store_f ? "IF:-:" : "", linebuf);
+      strcpy(pending[(head + inflight + n) % depth], linebuf);
+      ++n;
+    }
+    if (n == 0) continue;
+    if (batch_f) {
+      l = snprintf(batchhdr, sizeof batchhdr, "BATCH:%d\n", n);
+      if (send(sockfd, batchhdr, l, MSG_MORE) == -1){
         perror("send");
         global_exit(1);
       }
-      continue;
     }
-    if (add_newline(linebuf, LINE_SIZE)) {
-      fprintf(stderr, "Command too long.\n");
-      continue;
-    }
-    if (send(sockfd, linebuf, strlen(linebuf), 0) == -1){
+    if (send(sockfd, names, len, 0) == -1){
       perror("send");
       global_exit(1);
     }
-    remove_newline(linebuf);
-    line = recvline();
-    t = strtok(line,DELIM);
-    if (strcmp(t, "ERROR") == 0){
-      t = strtok(NULL,DELIM);
-      fprintf(stderr, "Server> Error: %s\n", t);
-    } else if (strcmp(t, "FILE") == 0) {
-      t = strtok(NULL,DELIM);
-      errno = 0;
-      size_t filesize = (size_t)strtol(t,NULL,0);
-      if (errno == ERANGE) {
-        fprintf(stderr,"Fatal Error: Could not parse file size.\n", t);
-        global_exit(0);
-      }
-      if (!arguments.devnull) {
-        l = snprintf(NULL, 0, "%s/%s", foldertmp, linebuf);
-        filename = (char *)emalloc(l+1);
-        snprintf(filename, l+1, "%s/%s", foldertmp, linebuf);
-      } else {
-        filename = (char *)emalloc(10);
-        snprintf(filename, 10, "/dev/null");
-      }
-      file = fopen(filename,"wb");
-      efree(filename);
-      chunk = (filesize > MAX_FILE_BUFFER) ? MAX_FILE_BUFFER : filesize;
-      filebuf = (char *)emalloc(chunk);
-      remain = filesize;
-      total = 0;
-      if (buffer->used > 0){
-        fwrite(buffer->data, 1, buffer->used, file);
-        total += buffer->used;
-        remain -= buffer->used;
-        buffer->used = 0;
-      }
-      fprintf(stderr,"'%s' [%ld/%ld] (%ld%%)", linebuf, (long)total, (long)filesize, (long)(100*total)/filesize);
-      while (remain > 0) {
-        read = recv(sockfd, filebuf, chunk, 0);
-        if (read == -1) {
-          perror("recv");
-          global_exit(3);
-        } else if (read == 0) {
-          fprintf(stderr,"Server dropped connection.\n");
-          global_exit(4);
-        }
-        total += read;
-        remain -= read;
-        fprintf(stderr,"%c[2K\r", 27);
-        fprintf(stderr,"'%s' [%ld/%ld] (%ld%%)", linebuf, (long)total, (long)filesize, (long)(100*total)/filesize);
-        fwrite(filebuf, 1, read, file);
-      }
-      fprintf(stderr,"%c[2K\r", 27);
-      printf("'%s' saved. [%ld/%ld]\n", linebuf, (long)total, (long)filesize);
-      fclose(file);
-      efree(filebuf);
-    } else {
-      verbose("Ignoring unexpected message from server: %s\n", t);
-    }
-    efree(line);
+    inflight += n;
   }
 }
@@ -9,8 +9,10 @@
 #include <string.h>
 #include <ctype.h>       /* isdigit() */
 #include <errno.h>
+#include <unistd.h>      /* dup(), close() */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>     /* stat(), mkdir() */
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
@@ -25,11 +27,22 @@
 #define BUFFER_SIZE 1024
 #define LINE_SIZE 256
 #define MAX_FILE_BUFFER 1048576
+#define PIPELINE_DEPTH 16
 #define DELIM ":"
+#define VALIDATOR_LEN 56
+#define STORE_BUCKETS 256
+#define STORE_MANIFEST ".validators"
 
 typedef struct _readbuffer {
   size_t used;
   char data[BUFFER_SIZE];
 } readbuffer;
 
+/* Validator of a file kept in the output directory */
+typedef struct _stored {
+  char *name;
+  char validator[VALIDATOR_LEN];
+  struct _stored *next;
+} stored;
+
 #endif
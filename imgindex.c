@@ -0,0 +1,104 @@
+#include "imgindex.h"
+
+static unsigned long hash_name(const char *s) {
+  unsigned long h = 2166136261UL; /* FNV-1a */
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+static void insert(imgindex_t *idx, img_entry *e) {
+  img_entry **old, *p, *next;
+  size_t i, n;
+  if (idx->count + 1 > idx->nbuckets) {
+    /* Keep the load factor at or below 1 */
+    old = idx->buckets;
+    n = idx->nbuckets;
+    idx->nbuckets = n ? n * 2 : IMGINDEX_MIN_BUCKETS;
+    idx->buckets = (img_entry **)ecalloc(idx->nbuckets, sizeof(img_entry *));
+    for (i = 0; i < n; ++i) {
+      for (p = old[i]; p; p = next) {
+        next = p->next;
+        p->next = idx->buckets[hash_name(p->name) % idx->nbuckets];
+        idx->buckets[hash_name(p->name) % idx->nbuckets] = p;
+      }
+    }
+    if (old)
+      efree(old);
+  }
+  e->next = idx->buckets[hash_name(e->name) % idx->nbuckets];
+  idx->buckets[hash_name(e->name) % idx->nbuckets] = e;
+  ++idx->count;
+  if (S_ISREG(e->mode))
+    idx->bytes += e->size;
+}
+
+/* Indexes every entry of the directory at dirfd under prefix, descending
+   into real subdirectories but not through symlinked ones. */
+static int scan(imgindex_t *idx, int dirfd, const char *prefix, int depth) {
+  DIR *dir;
+  struct dirent *d;
+  struct stat st, lst;
+  img_entry *e;
+  char *name;
+  int fd, len;
+  if ((fd = dup(dirfd)) == -1)
+    return -1;
+  if ((dir = fdopendir(fd)) == NULL) {
+    close(fd);
+    return -1;
+  }
+  while ((d = readdir(dir)) != NULL) {
+    if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+      continue;
+    if (fstatat(dirfd, d->d_name, &st, 0) == -1)
+      continue; /* Dangling symlink or raced with an unlink */
+    if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+      continue;
+    len = snprintf(NULL, 0, "%s%s", prefix, d->d_name);
+    name = (char *)emalloc(len+1);
+    snprintf(name, len+1, "%s%s", prefix, d->d_name);
+    e = ALLOC(img_entry);
+    e->name = name;
+    e->ino = st.st_ino;
+    e->size = st.st_size;
+    e->mode = st.st_mode;
+    e->mtime = st.st_mtim;
+    insert(idx, e);
+    if (S_ISDIR(st.st_mode) && depth < IMGINDEX_MAX_DEPTH &&
+        fstatat(dirfd, d->d_name, &lst, AT_SYMLINK_NOFOLLOW) == 0 &&
+        S_ISDIR(lst.st_mode)) {
+      char *sub = (char *)emalloc(len+2);
+      snprintf(sub, len+2, "%s/", name);
+      if ((fd = openat(dirfd, d->d_name, O_RDONLY | O_DIRECTORY)) != -1) {
+        scan(idx, fd, sub, depth + 1);
+        close(fd);
+      }
+      efree(sub);
+    }
+  }
+  closedir(dir);
+  return 0;
+}
+
+/* Builds the index of dir. Images added after this are not served until
+   the index is rebuilt. */
+int imgindex_build(imgindex_t *idx, const char *dir) {
+  memset(idx, 0, sizeof(imgindex_t));
+  if ((idx->dirfd = open(dir, O_RDONLY | O_DIRECTORY)) == -1)
+    return -1;
+  return scan(idx, idx->dirfd, "", 0);
+}
+
+img_entry *imgindex_lookup(imgindex_t *idx, const char *name) {
+  img_entry *e;
+  if (idx->nbuckets == 0)
+    return NULL;
+  for (e = idx->buckets[hash_name(name) % idx->nbuckets]; e; e = e->next) {
+    if (strcmp(e->name, name) == 0)
+      return e;
+  }
+  return NULL;
+}
@@ -0,0 +1,39 @@
+#ifndef IMGINDEX_H
+#define IMGINDEX_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "memory.h"
+
+#define IMGINDEX_MIN_BUCKETS 64
+#define IMGINDEX_MAX_DEPTH 16
+#define VALIDATOR_LEN 56
+
+typedef struct _img_entry {
+  char *name;     /* Relative to the indexed directory */
+  ino_t ino;
+  off_t size;
+  mode_t mode;
+  struct timespec mtime;
+  struct _img_entry *next;
+} img_entry;
+
+/* Immutable once built, so lookups need no locking */
+typedef struct _imgindex {
+  int dirfd;      /* Held open for openat() */
+  img_entry **buckets;
+  size_t nbuckets;
+  size_t count;
+  off_t bytes;
+} imgindex_t;
+
+int imgindex_build(imgindex_t *idx, const char *dir);
+img_entry *imgindex_lookup(imgindex_t *idx, const char *name);
+
+#endif
@@ -0,0 +1,52 @@
+#include "lfstack.h"
+
+void lfstack_init(lfstack_t *s, uint32_t capacity) {
+  s->head = 0;
+  s->capacity = capacity;
+  s->next = (uint32_t *)emalloc(capacity * sizeof(uint32_t));
+  memset(s->next, 0, capacity * sizeof(uint32_t));
+}
+
+void lfstack_destroy(lfstack_t *s) {
+  efree(s->next);
+  s->next = NULL;
+}
+
+void lfstack_push(lfstack_t *s, uint32_t i) {
+  uint64_t old, new;
+  old = __atomic_load_n(&s->head, __ATOMIC_RELAXED);
+  do {
+    __atomic_store_n(&s->next[i], (uint32_t)old, __ATOMIC_RELAXED);
+    new = (old & ~0xffffffffULL) | (i + 1);
+  } while (!__atomic_compare_exchange_n(&s->head, &old, new, 1,
+      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Returns the index on top, -1 when the stack is empty */
+int64_t lfstack_pop(lfstack_t *s) {
+  uint64_t old, new;
+  uint32_t top;
+  old = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+  do {
+    top = (uint32_t)old;
+    if (top == 0)
+      return -1;
+    /* May read a link already rewritten by another pop and push, the tag
+       makes the exchange fail in that case */
+    new = ((old >> 32) + 1) << 32 |
+      __atomic_load_n(&s->next[top - 1], __ATOMIC_RELAXED);
+  } while (!__atomic_compare_exchange_n(&s->head, &old, new, 1,
+      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+  return top - 1;
+}
+
+int futex_wait(int *word, int val, const struct timespec *deadline) {
+  /* WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline */
+  return syscall(SYS_futex, word, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG,
+    val, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+int futex_wake(int *word, int n) {
+  return syscall(SYS_futex, word, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, n,
+    NULL, NULL, 0);
+}
@@ -0,0 +1,31 @@
+#ifndef LFSTACK_H
+#define LFSTACK_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "memory.h"
+
+/* Treiber stack of the indices 0..capacity-1. The head carries a tag
+   bumped on every pop so a stale head cannot be swapped back in (ABA).
+   Each index may be on the stack at most once. */
+typedef struct _lfstack {
+  uint64_t head;   /* tag << 32 | (index + 1), index part 0 when empty */
+  uint32_t *next;  /* next[i] is the index + 1 below i */
+  uint32_t capacity;
+} lfstack_t;
+
+void lfstack_init(lfstack_t *s, uint32_t capacity);
+void lfstack_destroy(lfstack_t *s);
+void lfstack_push(lfstack_t *s, uint32_t i);
+int64_t lfstack_pop(lfstack_t *s);
+
+/* Sleeps while *word == val, until woken or the CLOCK_MONOTONIC deadline
+   (NULL for none). Returns 0 or -1 with errno ETIMEDOUT, EAGAIN, EINTR. */
+int futex_wait(int *word, int val, const struct timespec *deadline);
+int futex_wake(int *word, int n);
+
+#endif
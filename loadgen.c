@@ -0,0 +1,784 @@
+#include "loadgen.h"
+
+/**
+ Globals
+*/
+const char *program_name;
+static int verbose_f;
+static int adaptive_f;
+static int open_f;       /* Arrivals at a fixed rate rather than on completion */
+static int speed_every;
+static struct sockaddr_storage server_addr;
+static socklen_t server_addrlen;
+static char **names;
+static double *name_cdf; /* Zipf distribution over names, cumulative */
+static int name_count;
+static uint64_t start_ns;
+static uint64_t end_ns;  /* Brought forward by SIGINT */
+
+/**
+ Misc. Helper Functions
+*/
+static void verbose(const char *format, ...) {
+  if (!verbose_f) return;
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t stop_ns(void) {
+  return __atomic_load_n(&end_ns, __ATOMIC_RELAXED);
+}
+
+/* Counters are only written by their thread, so this needs no RMW */
+static void stat_add(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static uint64_t stat_get(uint64_t *counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* xorshift64* */
+static uint64_t rng_next(uint64_t *s) {
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * 2685821657736338717ULL;
+}
+
+static double rng_unit(uint64_t *s) {
+  return (rng_next(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void format_ns(char *buf, size_t size, uint64_t ns) {
+  if (ns < 1000)
+    snprintf(buf, size, "%lluns", (unsigned long long)ns);
+  else if (ns < 1000000)
+    snprintf(buf, size, "%.1fus", ns / 1e3);
+  else if (ns < 1000000000)
+    snprintf(buf, size, "%.2fms", ns / 1e6);
+  else
+    snprintf(buf, size, "%.2fs", ns / 1e9);
+}
+
+/**
+  Latency Histograms
+  Values below 2 * LOAD_SUB get a bucket each; above that every power of
+  two is split into LOAD_SUB buckets.
+*/
+static int hist_index(uint64_t v) {
+  int shift, i;
+  if (v < 2 * LOAD_SUB)
+    return (int)v;
+  shift = 63 - __builtin_clzll(v) - LOAD_SUB_BITS;
+  i = shift * LOAD_SUB + (int)(v >> shift);
+  return i < LOAD_BUCKETS ? i : LOAD_BUCKETS - 1;
+}
+
+/* Middle of the values bucket i holds */
+static uint64_t hist_value(int i) {
+  int shift;
+  if (i < 2 * LOAD_SUB)
+    return (uint64_t)i;
+  shift = i / LOAD_SUB - 1;
+  return ((uint64_t)(i % LOAD_SUB + LOAD_SUB) << shift) + ((1ULL << shift) >> 1);
+}
+
+static void hist_add(load_hist *h, uint64_t v, uint64_t n) {
+  h->bucket[hist_index(v)] += n;
+  h->count += n;
+  if (v > h->max)
+    h->max = v;
+}
+
+static void hist_merge(load_hist *dst, const load_hist *src) {
+  int i;
+  for (i = 0; i < LOAD_BUCKETS; ++i)
+    dst->bucket[i] += src->bucket[i];
+  dst->count += src->count;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+static uint64_t hist_percentile(const load_hist *h, double q) {
+  uint64_t need = (uint64_t)ceil(q * h->count), seen = 0, v;
+  int i;
+  if (need == 0)
+    need = 1;
+  for (i = 0; i < LOAD_BUCKETS; ++i) {
+    seen += h->bucket[i];
+    if (seen >= need) {
+      v = hist_value(i);
+      return v < h->max ? v : h->max;
+    }
+  }
+  return h->max;
+}
+
+/* Copies src into dst along with the samples a closed loop never took.
+   A response that took n intervals held back the n - 1 requests that
+   would have followed it, each of which would have waited one interval
+   less. */
+static void hist_correct(load_hist *dst, const load_hist *src, uint64_t interval) {
+  uint64_t v, missing;
+  int i;
+  *dst = *src;
+  if (interval == 0)
+    return;
+  for (i = 0; i < LOAD_BUCKETS; ++i) {
+    if (src->bucket[i] == 0)
+      continue;
+    v = i == hist_index(src->max) ? src->max : hist_value(i);
+    for (missing = v > interval ? v - interval : 0; missing >= interval; missing -= interval)
+      hist_add(dst, missing, src->bucket[i]);
+  }
+}
+
+/**
+  Request Names
+  Every file in the image directory, ranked by name, the first the most
+  often requested.
+*/
+static int name_filter(const struct dirent *d) {
+  return d->d_name[0] != '.' && strlen(d->d_name) < LINE_SIZE - 1;
+}
+
+static int names_load(const char *dir, double skew) {
+  struct dirent **list;
+  char path[LINE_SIZE * 2];
+  struct stat st;
+  double total = 0;
+  int n, i;
+  if ((n = scandir(dir, &list, name_filter, alphasort)) == -1)
+    return -1;
+  names = ALLOC_N(char *, n > 0 ? n : 1);
+  name_cdf = ALLOC_N(double, n > 0 ? n : 1);
+  for (i = 0; i < n; ++i) {
+    snprintf(path, sizeof path, "%s/%s", dir, list[i]->d_name);
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+      names[name_count] = estrdup(list[i]->d_name);
+      total += 1.0 / pow(name_count + 1, skew);
+      name_cdf[name_count++] = total;
+    }
+    free(list[i]);
+  }
+  free(list);
+  for (i = 0; i < name_count; ++i)
+    name_cdf[i] /= total;
+  return name_count;
+}
+
+static const char *name_pick(uint64_t *rng) {
+  double u = rng_unit(rng);
+  int lo = 0, hi = name_count - 1, mid;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (name_cdf[mid] > u)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return names[lo];
+}
+
+/**
+  Connections
+*/
+static void conn_fail(load_thread *t, load_conn *c, const char *why) {
+  verbose("Thread-%d: Connection %ld: %s", t->id, (long)(c - t->conns), why);
+  if (c->state == LOAD_READY) {
+    stat_add(&t->dropped, 1);
+    stat_add(&t->lost, c->inflight);
+  } else {
+    stat_add(&t->refused, 1);
+  }
+  if (c->fd != -1)
+    close(c->fd);
+  c->fd = -1;
+  c->state = LOAD_DOWN;
+  ++t->down;
+}
+
+static void conn_open(load_thread *t, load_conn *c) {
+  struct epoll_event ev;
+  int one = 1;
+  c->state = LOAD_CONNECTING;
+  c->head = 0;
+  c->inflight = 0;
+  c->body = 0;
+  c->used = 0;
+  c->out_off = 0;
+  c->out_len = 0;
+  c->since_speed = 0;
+  c->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (c->fd == -1) {
+    conn_fail(t, c, strerror(errno));
+    return;
+  }
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  if (connect(c->fd, (struct sockaddr *)&server_addr, server_addrlen) == -1 &&
+      errno != EINPROGRESS) {
+    conn_fail(t, c, strerror(errno));
+    return;
+  }
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = c;
+  if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+    conn_fail(t, c, strerror(errno));
+}
+
+/* Sends what the socket will take, returning -1 if the connection failed */
+static int conn_flush(load_thread *t, load_conn *c) {
+  ssize_t r;
+  while (c->out_off < c->out_len) {
+    r = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (r == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      conn_fail(t, c, strerror(errno));
+      return -1;
+    }
+    c->out_off += r;
+  }
+  c->out_off = 0;
+  c->out_len = 0;
+  return 0;
+}
+
+static void conn_queue(load_conn *c, const char *data, size_t len) {
+  if (c->out_off > 0) {
+    memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+    c->out_len -= c->out_off;
+    c->out_off = 0;
+  }
+  memcpy(c->out + c->out_len, data, len);
+  c->out_len += len;
+}
+
+/* Pan speeds take a step up or down, as a user scrolling would */
+static void speed_update(load_thread *t, load_conn *c) {
+  char line[24];
+  if (c->speed == 0)
+    c->speed = 1 + (int)(rng_next(&t->rng) % LOAD_MAX_SPEED);
+  else if (rng_next(&t->rng) & 1)
+    c->speed += c->speed < LOAD_MAX_SPEED ? 1 : -1;
+  else
+    c->speed -= c->speed > 1 ? 1 : -1;
+  conn_queue(c, line, snprintf(line, sizeof line, "SPEED:%d\n", c->speed));
+  c->since_speed = 0;
+}
+
+/* Sends a request that was due at intended */
+static int send_request(load_thread *t, load_conn *c, uint64_t intended) {
+  char line[LINE_SIZE + 1];
+  int slot = (c->head + c->inflight) % LOAD_PIPELINE;
+  if (adaptive_f && ++c->since_speed >= speed_every)
+    speed_update(t, c);
+  conn_queue(c, line, snprintf(line, sizeof line, "%s\n", name_pick(&t->rng)));
+  c->intended[slot] = intended;
+  c->sent[slot] = now_ns();
+  ++c->inflight;
+  return conn_flush(t, c);
+}
+
+/* Records the response to the oldest outstanding request. In a closed
+   loop the connection goes straight on to the next. */
+static int complete(load_thread *t, load_conn *c, int ok) {
+  uint64_t now = now_ns();
+  if (ok) {
+    hist_add(&t->raw, now - c->sent[c->head], 1);
+    hist_add(&t->corrected, now - c->intended[c->head], 1);
+    stat_add(&t->bytes, c->body_size);
+    stat_add(&t->done, 1);
+  } else {
+    stat_add(&t->errors, 1);
+  }
+  c->head = (c->head + 1) % LOAD_PIPELINE;
+  --c->inflight;
+  if (!open_f && now < stop_ns())
+    return send_request(t, c, now);
+  return 0;
+}
+
+/* Handles one response line, returning -1 if the connection failed */
+static int conn_line(load_thread *t, load_conn *c, char *line) {
+  if (c->state == LOAD_HELLO) {
+    if (strncmp(line, "HELLO:", 6) != 0) {
+      conn_fail(t, c, "unexpected greeting");
+      return -1;
+    }
+    if (adaptive_f) {
+      if (strstr(line, ":SPEED") == NULL) {
+        fprintf(stderr, "Server is not in adaptive mode, or takes no SPEED updates.\n");
+        exit(1);
+      }
+      c->speed = 0;
+      speed_update(t, c); /* Registers the client */
+    }
+    c->state = LOAD_READY;
+    if (!open_f)
+      return send_request(t, c, now_ns());
+    return conn_flush(t, c);
+  }
+  if (c->inflight == 0) {
+    conn_fail(t, c, "unrequested response");
+    return -1;
+  }
+  if (strncmp(line, "FILE:", 5) == 0) {
+    c->body_size = c->body = (size_t)strtoull(line + 5, NULL, 10);
+    return c->body == 0 ? complete(t, c, 1) : 0;
+  }
+  if (strncmp(line, "ERROR:", 6) == 0) {
+    verbose("Thread-%d: %s", t->id, line);
+    return complete(t, c, 0);
+  }
+  conn_fail(t, c, "unexpected response");
+  return -1;
+}
+
+static void conn_readable(load_thread *t, load_conn *c) {
+  char *p, *end, *nl;
+  size_t take;
+  ssize_t r;
+  for (;;) {
+    r = recv(c->fd, t->buf, LOAD_BUFFER, 0);
+    if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (r <= 0) {
+      conn_fail(t, c, r == 0 ? "closed by server" : strerror(errno));
+      return;
+    }
+    for (p = t->buf, end = t->buf + r; p < end; ) {
+      if (c->body > 0) {
+        take = (size_t)(end - p) < c->body ? (size_t)(end - p) : c->body;
+        c->body -= take;
+        p += take;
+        if (c->body == 0 && complete(t, c, 1) == -1)
+          return;
+        continue;
+      }
+      nl = (char *)memchr(p, '\n', end - p);
+      take = (nl ? nl : end) - p;
+      if (c->used + take >= LINE_SIZE) {
+        conn_fail(t, c, "response line too long");
+        return;
+      }
+      memcpy(c->line + c->used, p, take);
+      c->used += take;
+      p += take;
+      if (!nl)
+        break;
+      ++p;
+      c->line[c->used] = '\0';
+      c->used = 0;
+      if (conn_line(t, c, c->line) == -1)
+        return;
+    }
+  }
+}
+
+static void conn_event(load_thread *t, load_conn *c, uint32_t events) {
+  socklen_t len = sizeof(int);
+  int err = 0;
+  if (c->state == LOAD_CONNECTING) {
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err) {
+      conn_fail(t, c, strerror(err));
+      return;
+    }
+    c->state = LOAD_HELLO;
+  }
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    conn_readable(t, c);
+  if (c->state != LOAD_DOWN && (events & EPOLLOUT))
+    conn_flush(t, c);
+}
+
+/**
+  Load Threads
+*/
+
+/* Hands every arrival that is due to a connection with room for it. Those
+   that find none stay due, so their wait counts against the server. */
+static void issue_due(load_thread *t) {
+  struct itimerspec its;
+  uint64_t now = now_ns(), stop = stop_ns();
+  load_conn *c;
+  int k;
+  while (t->next_due <= now && t->next_due < stop) {
+    for (k = 0; k < t->nconns; ++k) {
+      c = &t->conns[(t->next + k) % t->nconns];
+      if (c->state == LOAD_READY && c->inflight < LOAD_PIPELINE)
+        break;
+    }
+    if (k == t->nconns)
+      break;
+    t->next = (t->next + k + 1) % t->nconns;
+    t->next_due += t->interval_ns;
+    send_request(t, c, t->next_due - t->interval_ns);
+  }
+  if (t->next_due > now && t->next_due < stop && t->armed != t->next_due) {
+    memset(&its, 0, sizeof its);
+    its.it_value.tv_sec = t->next_due / 1000000000ULL;
+    its.it_value.tv_nsec = t->next_due % 1000000000ULL;
+    timerfd_settime(t->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+    t->armed = t->next_due;
+  }
+}
+
+static void *load_run(void *arg) {
+  load_thread *t = (load_thread *)arg;
+  struct epoll_event ev, events[LOAD_EVENTS];
+  uint64_t now, stop, expirations;
+  int i, n, timeout;
+  t->epfd = epoll_create1(0);
+  t->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (t->epfd == -1 || t->timerfd == -1) {
+    perror("epoll");
+    exit(1);
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->timerfd, &ev);
+  for (i = 0; i < t->nconns; ++i)
+    conn_open(t, &t->conns[i]);
+  if (t->down)
+    t->retry_ns = now_ns() + LOAD_RETRY_MS * 1000000ULL;
+  while ((now = now_ns()) < (stop = stop_ns())) {
+    timeout = (int)((stop - now) / 1000000) + 1;
+    if (t->down && timeout > LOAD_RETRY_MS)
+      timeout = LOAD_RETRY_MS;
+    n = epoll_wait(t->epfd, events, LOAD_EVENTS, timeout);
+    for (i = 0; i < n; ++i) {
+      if (events[i].data.ptr == NULL) {
+        if (read(t->timerfd, &expirations, sizeof expirations) == -1 && errno != EAGAIN)
+          perror("read");
+        t->armed = 0;
+      } else if (((load_conn *)events[i].data.ptr)->state != LOAD_DOWN) {
+        conn_event(t, (load_conn *)events[i].data.ptr, events[i].events);
+      }
+    }
+    if (open_f)
+      issue_due(t);
+    if (t->down && now_ns() >= t->retry_ns) {
+      for (i = 0; i < t->nconns; ++i) {
+        if (t->conns[i].state == LOAD_DOWN) {
+          --t->down;
+          conn_open(t, &t->conns[i]);
+        }
+      }
+      t->retry_ns = now_ns() + LOAD_RETRY_MS * 1000000ULL;
+    }
+  }
+  stop = stop_ns();
+  if (open_f && t->next_due < stop)
+    t->unsent = (stop - t->next_due + t->interval_ns - 1) / t->interval_ns;
+  for (i = 0; i < t->nconns; ++i) {
+    if (t->conns[i].fd != -1)
+      close(t->conns[i].fd);
+  }
+  close(t->timerfd);
+  close(t->epfd);
+  return NULL;
+}
+
+/**
+  Main
+*/
+static void interrupt(int sig) {
+  __atomic_store_n(&end_ns, now_ns(), __ATOMIC_RELAXED);
+}
+
+static void print_latency(const char *label, const load_hist *h) {
+  static const double q[3] = {0.5, 0.99, 0.999};
+  char v[24];
+  int i;
+  printf("  %-10s", label);
+  for (i = 0; i < 3; ++i) {
+    format_ns(v, sizeof v, hist_percentile(h, q[i]));
+    printf(" %10s", v);
+  }
+  format_ns(v, sizeof v, h->max);
+  printf(" %10s\n", v);
+}
+
+#define DOC_BUFFER_LEN 320
+
+static char doc[DOC_BUFFER_LEN];
+static char args_doc[] = "HOST PORT";
+
+static struct argp_option options[] = {
+  {"threads",     't', "N", 0, "Event loop threads (default 4)" },
+  {"connections", 'c', "N", 0, "Connections, spread over the threads (default 100)" },
+  {"rate",        'r', "N", 0, "Open loop: N requests a second in all, each timed from when it was due. Without it every connection sends its next request as the last is answered" },
+  {"expected-interval", 'e', "MS", 0, "Closed loop: also report latency corrected for coordinated omission, filling in the requests a stall held back at one every MS milliseconds per connection. Only the caller knows the pace the workload should keep, so nothing is corrected without it" },
+  {"duration",    'd', "SECS", 0, "Length of the run (default 10)" },
+  {"images",      'i', "DIR", 0, "Requests the files in DIR, the server's image directory or a copy of it (default imgs)" },
+  {"zipf",        'z', "S", 0, "Zipf exponent of the name distribution, 0 for uniform (default 1)" },
+  {"adaptive",    'a', 0, 0, "Sends in-band pan speed updates. Server must be run in adaptive mode" },
+  {"speed-every", 's', "N", 0, "Requests between speed updates with --adaptive (default 8)" },
+  {"verbose",     'v', 0, 0, "Reports connection failures and ERROR replies" },
+  { 0 }
+};
+
+struct arguments {
+  int port;
+  int threads, connections, duration, adaptive, speed_every, verbose;
+  double rate, zipf, expected_ms;
+  char *host, *images;
+};
+
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+  struct arguments *arguments = state->input;
+  char *end;
+
+  switch (key){
+  case 't':
+    arguments->threads = (int)strtol(arg, &end, 10);
+    if (*end || arguments->threads < 1)
+      argp_error(state, "--threads needs a positive number");
+    break;
+  case 'c':
+    arguments->connections = (int)strtol(arg, &end, 10);
+    if (*end || arguments->connections < 1)
+      argp_error(state, "--connections needs a positive number");
+    break;
+  case 'r':
+    arguments->rate = strtod(arg, &end);
+    if (*end || !(arguments->rate > 0))
+      argp_error(state, "--rate needs a positive number");
+    break;
+  case 'e':
+    arguments->expected_ms = strtod(arg, &end);
+    if (*end || !(arguments->expected_ms > 0))
+      argp_error(state, "--expected-interval needs a positive number of milliseconds");
+    break;
+  case 'd':
+    arguments->duration = (int)strtol(arg, &end, 10);
+    if (*end || arguments->duration < 1)
+      argp_error(state, "--duration needs a positive number of seconds");
+    break;
+  case 'i':
+    arguments->images = arg;
+    break;
+  case 'z':
+    arguments->zipf = strtod(arg, &end);
+    if (*end || !(arguments->zipf >= 0))
+      argp_error(state, "--zipf needs a number of at least 0");
+    break;
+  case 'a':
+    arguments->adaptive = 1;
+    break;
+  case 's':
+    arguments->speed_every = (int)strtol(arg, &end, 10);
+    if (*end || arguments->speed_every < 1)
+      argp_error(state, "--speed-every needs a positive number");
+    break;
+  case 'v':
+    arguments->verbose = 1;
+    break;
+
+  case ARGP_KEY_ARG:
+    if (state->arg_num == 0) {
+      arguments->host = arg;
+    } else if (state->arg_num == 1) {
+      errno = 0;
+      arguments->port = (int)strtol(arg,NULL,0);
+      if (errno == ERANGE) {
+        argp_usage(state);
+      }
+    } else {
+      argp_usage(state);
+    }
+    break;
+
+  case ARGP_KEY_END:
+    if (state->arg_num < 2)
+      argp_usage(state);
+    if (arguments->threads > arguments->connections)
+      argp_error(state, "--threads cannot exceed --connections");
+    if (arguments->speed_every > 0 && !arguments->adaptive)
+      argp_error(state, "--speed-every needs --adaptive");
+    if (arguments->expected_ms > 0 && arguments->rate > 0)
+      argp_error(state, "--expected-interval is for closed loops, --rate already times requests from when they were due");
+    break;
+
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc };
+
+int main(int argc, char **argv) {
+  struct arguments arguments;
+  struct addrinfo hints, *res;
+  struct rlimit rl;
+  struct timespec tick;
+  load_thread *threads;
+  load_hist raw, corrected;
+  char portstr[16], v[24];
+  uint64_t done, bytes, errors, last_done = 0, last_bytes = 0, unsent = 0;
+  uint64_t refused = 0, dropped = 0, lost = 0, interval = 0, now;
+  double elapsed;
+  int i, r, second = 0, given = 0;
+
+  program_name = argv[0];
+  snprintf(doc, DOC_BUFFER_LEN, "%s -- drives a server with many connections from a few "
+    "threads and reports throughput and latency percentiles", program_name);
+  arguments.port = -1;
+  arguments.host = NULL;
+  arguments.threads = 4;
+  arguments.connections = 100;
+  arguments.duration = 10;
+  arguments.adaptive = 0;
+  arguments.speed_every = 0;
+  arguments.verbose = 0;
+  arguments.rate = 0;
+  arguments.expected_ms = 0;
+  arguments.zipf = 1;
+  arguments.images = "imgs";
+
+  argp_parse (&argp, argc, argv, 0, 0, &arguments);
+
+  verbose_f = arguments.verbose;
+  adaptive_f = arguments.adaptive;
+  speed_every = arguments.speed_every > 0 ? arguments.speed_every : 8;
+  open_f = arguments.rate > 0;
+
+  if (names_load(arguments.images, arguments.zipf) <= 0) {
+    fprintf(stderr, "No images to request in %s.\n", arguments.images);
+    exit(1);
+  }
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(portstr, sizeof portstr, "%d", arguments.port);
+  if ((r = getaddrinfo(arguments.host, portstr, &hints, &res)) != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(r));
+    exit(1);
+  }
+  memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
+  server_addrlen = res->ai_addrlen;
+  freeaddrinfo(res);
+
+  /* Every connection is a descriptor */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+      rl.rlim_cur < (rlim_t)arguments.connections + 2 * arguments.threads + 16)
+    fprintf(stderr, "Warning: only %lu descriptors for %d connections.\n",
+      (unsigned long)rl.rlim_cur, arguments.connections);
+
+  signal(SIGINT, interrupt);
+  threads = (load_thread *)ecalloc(arguments.threads, sizeof(load_thread));
+  start_ns = now_ns();
+  end_ns = start_ns + (uint64_t)arguments.duration * 1000000000ULL;
+  for (i = 0; i < arguments.threads; ++i) {
+    threads[i].id = i;
+    threads[i].nconns = arguments.connections / arguments.threads +
+      (i < arguments.connections % arguments.threads);
+    threads[i].conns = (load_conn *)ecalloc(threads[i].nconns, sizeof(load_conn));
+    threads[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1) ^ start_ns;
+    if (open_f) {
+      /* Threads take turns, so arrivals stay evenly spaced in all */
+      threads[i].interval_ns = (uint64_t)(1e9 * arguments.threads / arguments.rate);
+      threads[i].next_due = start_ns + threads[i].interval_ns * i / arguments.threads;
+    }
+    if ((errno = pthread_create(&threads[i].thread, NULL, load_run, &threads[i])) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+  fprintf(stderr, "%s loop, %d connections on %d threads for %ds, %d names.\n",
+    open_f ? "Open" : "Closed", arguments.connections, arguments.threads,
+    arguments.duration, name_count);
+
+  /* A progress line a second */
+  while ((now = now_ns()) < stop_ns()) {
+    uint64_t next = start_ns + (uint64_t)(second + 1) * 1000000000ULL;
+    if (next > stop_ns())
+      next = stop_ns();
+    if (next > now) {
+      tick.tv_sec = (next - now) / 1000000000ULL;
+      tick.tv_nsec = (next - now) % 1000000000ULL;
+      nanosleep(&tick, NULL);
+    }
+    if (now_ns() < next)
+      continue;
+    ++second;
+    done = bytes = errors = 0;
+    for (i = 0; i < arguments.threads; ++i) {
+      done += stat_get(&threads[i].done);
+      bytes += stat_get(&threads[i].bytes);
+      errors += stat_get(&threads[i].errors) + stat_get(&threads[i].lost);
+    }
+    fprintf(stderr, "%4ds %10llu req/s %9.1f MB/s %8llu errors\n", second,
+      (unsigned long long)(done - last_done), (bytes - last_bytes) / 1e6,
+      (unsigned long long)errors);
+    last_done = done;
+    last_bytes = bytes;
+  }
+
+  memset(&raw, 0, sizeof raw);
+  memset(&corrected, 0, sizeof corrected);
+  done = bytes = errors = 0;
+  for (i = 0; i < arguments.threads; ++i) {
+    pthread_join(threads[i].thread, NULL);
+    hist_merge(&raw, &threads[i].raw);
+    hist_merge(&corrected, &threads[i].corrected);
+    done += threads[i].done;
+    bytes += threads[i].bytes;
+    errors += threads[i].errors;
+    refused += threads[i].refused;
+    dropped += threads[i].dropped;
+    lost += threads[i].lost;
+    unsent += threads[i].unsent;
+    given += threads[i].nconns;
+    efree(threads[i].conns);
+  }
+  efree(threads);
+  elapsed = (stop_ns() - start_ns) / 1e9;
+
+  /* A closed loop times requests from when they went out, so a stall also
+     hides the requests that would have been sent during it. Those are
+     filled in at the interval the caller expects, never at one guessed from
+     the responses, which a closed loop paces itself. */
+  interval = (uint64_t)(arguments.expected_ms * 1e6);
+  if (!open_f && interval > 0)
+    hist_correct(&corrected, &raw, interval);
+  printf("%s loop, %d connections on %d threads, %.2fs\n", open_f ? "Open" : "Closed",
+    given, arguments.threads, elapsed);
+  if (open_f)
+    printf("Offered: %.1f req/s, %llu arrivals never sent\n", arguments.rate,
+      (unsigned long long)unsent);
+  printf("Requests: %llu, %.1f/s\n", (unsigned long long)done, done / elapsed);
+  printf("Received: %.1f MB, %.1f MB/s\n", bytes / 1e6, bytes / 1e6 / elapsed);
+  printf("Errors: %llu replies, %llu refused connections, %llu dropped connections "
+    "with %llu requests\n", (unsigned long long)errors, (unsigned long long)refused,
+    (unsigned long long)dropped, (unsigned long long)lost);
+  printf("Latency %14s %10s %10s %10s\n", "p50", "p99", "p999", "max");
+  print_latency("sent", &raw);
+  if (open_f || interval > 0)
+    print_latency(open_f ? "due" : "corrected", &corrected);
+  if (!open_f && interval > 0) {
+    format_ns(v, sizeof v, interval);
+    printf("Corrected for coordinated omission at an interval of %s.\n", v);
+  } else if (!open_f) {
+    printf("Not corrected for coordinated omission, see --expected-interval.\n");
+  }
+  mem_profile_dump(stderr);
+  return 0;
+}
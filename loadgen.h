@@ -0,0 +1,90 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>         /* pow() */
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <argp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h> /* setrlimit() */
+#include <netinet/in.h>
+#include <netinet/tcp.h>  /* TCP_NODELAY */
+#include <netdb.h>
+#include "memory.h"
+
+#define LINE_SIZE 256
+#define LOAD_BUFFER 65536   /* Per thread, bodies are read into it and dropped */
+#define LOAD_PIPELINE 16    /* Requests outstanding per connection, open loop */
+#define LOAD_OUT (LOAD_PIPELINE * (LINE_SIZE + 16))
+#define LOAD_EVENTS 256
+#define LOAD_RETRY_MS 100   /* Between attempts to reopen lost connections */
+#define LOAD_MAX_SPEED 10   /* Pan speeds wander between 1 and this */
+#define LOAD_SUB_BITS 4     /* Histogram buckets per power of two, as a shift */
+#define LOAD_SUB (1 << LOAD_SUB_BITS)
+#define LOAD_BUCKETS 608    /* Nanoseconds up to 2^41, about 36 minutes */
+
+enum { LOAD_DOWN, LOAD_CONNECTING, LOAD_HELLO, LOAD_READY };
+
+/* Log-linear latency histogram in nanoseconds, within 1/32 of the value */
+typedef struct _load_hist {
+  uint64_t count;
+  uint64_t max;
+  uint64_t bucket[LOAD_BUCKETS];
+} load_hist;
+
+typedef struct _load_conn {
+  int fd;
+  int state;
+  int head, inflight;            /* Ring of outstanding requests */
+  uint64_t intended[LOAD_PIPELINE]; /* When each request was due */
+  uint64_t sent[LOAD_PIPELINE];  /* When it went out */
+  size_t body;                   /* Bytes of the current body still to come */
+  size_t body_size;
+  int speed, since_speed;        /* Adaptive mode */
+  size_t used;                   /* Partial response line */
+  char line[LINE_SIZE];
+  size_t out_off, out_len;       /* Requests not yet taken by the socket */
+  char out[LOAD_OUT];
+} load_conn;
+
+/* One event loop and the connections it drives. The counters are written
+   by the thread alone and read for progress lines while it runs. */
+typedef struct _load_thread {
+  pthread_t thread;
+  int id;
+  int epfd;
+  int timerfd;
+  load_conn *conns;
+  int nconns;
+  int next;              /* Connection to try first for the next arrival */
+  int down;              /* Connections waiting to be reopened */
+  uint64_t retry_ns;
+  uint64_t interval_ns;  /* Between arrivals, open loop */
+  uint64_t next_due;
+  uint64_t armed;        /* Arrival the timer is set for */
+  uint64_t unsent;       /* Arrivals still waiting for a connection at the end */
+  uint64_t rng;
+  uint64_t done, bytes;
+  uint64_t errors;       /* ERROR replies */
+  uint64_t refused;      /* Connections that failed before HELLO */
+  uint64_t dropped;      /* Connections lost after HELLO */
+  uint64_t lost;         /* Requests outstanding on those */
+  load_hist raw;         /* From when each request went out */
+  load_hist corrected;   /* From when it was due */
+  char buf[LOAD_BUFFER];
+} load_thread;
+
+#endif
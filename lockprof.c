@@ -0,0 +1,176 @@
+#include "lockprof.h"
+
+#ifdef LOCK_PROFILE
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+typedef struct _lock_stats {
+  const char *name;
+  unsigned long acquired;
+  unsigned long contended; /* Had to wait at all */
+  uint64_t wait_ns, hold_ns;
+  uint64_t max_wait_ns, max_hold_ns;
+  unsigned long wait_hist[LOCKPROF_BUCKETS];
+  unsigned long hold_hist[LOCKPROF_BUCKETS];
+} lock_stats;
+
+/* Written once when the mutex is named, then only read, except for
+   held_since which only the holder touches */
+typedef struct _lock_slot {
+  pthread_mutex_t *mutex;
+  lock_stats *stats;
+  uint64_t held_since;
+} lock_slot;
+
+static lock_slot slots[LOCKPROF_SLOTS];
+static lock_stats names[LOCKPROF_NAMES];
+static int num_names;
+static pthread_mutex_t name_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int slot_hash(pthread_mutex_t *m) {
+  return (unsigned int)(((uintptr_t)m >> 4) % LOCKPROF_SLOTS);
+}
+
+/* The slot of m, NULL for mutexes that were never named */
+static lock_slot *slot_of(pthread_mutex_t *m) {
+  unsigned int h = slot_hash(m), i;
+  pthread_mutex_t *seen;
+  for (i = 0; i < LOCKPROF_SLOTS; ++i, h = (h + 1) % LOCKPROF_SLOTS) {
+    seen = __atomic_load_n(&slots[h].mutex, __ATOMIC_ACQUIRE);
+    if (seen == m)
+      return &slots[h];
+    if (!seen)
+      return NULL;
+  }
+  return NULL;
+}
+
+static void count(unsigned long *hist, uint64_t *total, uint64_t *max, uint64_t ns) {
+  int b = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+  uint64_t seen;
+  if (b >= LOCKPROF_BUCKETS)
+    b = LOCKPROF_BUCKETS - 1;
+  __atomic_add_fetch(&hist[b], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(total, ns, __ATOMIC_RELAXED);
+  seen = __atomic_load_n(max, __ATOMIC_RELAXED);
+  while (ns > seen && !__atomic_compare_exchange_n(max, &seen, ns, 1,
+      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/* Starts profiling m under name. Call before m is shared. */
+void lockprof_name(pthread_mutex_t *m, const char *name) {
+  lock_stats *st = NULL;
+  unsigned int h = slot_hash(m), i;
+  int n;
+  (pthread_mutex_lock)(&name_lock);
+  for (n = 0; n < num_names; ++n)
+    if (strcmp(names[n].name, name) == 0)
+      st = &names[n];
+  if (!st && num_names < LOCKPROF_NAMES) {
+    st = &names[num_names++];
+    st->name = name;
+  }
+  for (i = 0; st && i < LOCKPROF_SLOTS; ++i, h = (h + 1) % LOCKPROF_SLOTS) {
+    if (slots[h].mutex == m || !slots[h].mutex) {
+      slots[h].stats = st;
+      __atomic_store_n(&slots[h].mutex, m, __ATOMIC_RELEASE);
+      break;
+    }
+  }
+  (pthread_mutex_unlock)(&name_lock);
+}
+
+int lockprof_lock(pthread_mutex_t *m) {
+  lock_slot *s = slot_of(m);
+  uint64_t start, wait = 0;
+  int r;
+  if (!s)
+    return (pthread_mutex_lock)(m);
+  if ((r = pthread_mutex_trylock(m)) == EBUSY) {
+    start = now_ns();
+    if ((r = (pthread_mutex_lock)(m)) != 0)
+      return r;
+    s->held_since = now_ns();
+    wait = s->held_since - start;
+    __atomic_add_fetch(&s->stats->contended, 1, __ATOMIC_RELAXED);
+  } else if (r != 0) {
+    return r;
+  } else {
+    s->held_since = now_ns();
+  }
+  __atomic_add_fetch(&s->stats->acquired, 1, __ATOMIC_RELAXED);
+  count(s->stats->wait_hist, &s->stats->wait_ns, &s->stats->max_wait_ns, wait);
+  return 0;
+}
+
+int lockprof_unlock(pthread_mutex_t *m) {
+  lock_slot *s = slot_of(m);
+  lock_stats *st;
+  if (s) {
+    st = s->stats;
+    count(st->hold_hist, &st->hold_ns, &st->max_hold_ns, now_ns() - s->held_since);
+  }
+  return (pthread_mutex_unlock)(m);
+}
+
+/* The wait gives the mutex up, so it ends one hold and starts another */
+int lockprof_cond_wait(pthread_cond_t *c, pthread_mutex_t *m) {
+  lock_slot *s = slot_of(m);
+  lock_stats *st;
+  int r;
+  if (s) {
+    st = s->stats;
+    count(st->hold_hist, &st->hold_ns, &st->max_hold_ns, now_ns() - s->held_since);
+  }
+  r = (pthread_cond_wait)(c, m);
+  if (s)
+    s->held_since = now_ns();
+  return r;
+}
+
+/* Upper bound of the histogram bucket the p99 falls in */
+static uint64_t p99(const unsigned long *hist, unsigned long n) {
+  unsigned long seen = 0;
+  int b;
+  for (b = 0; b < LOCKPROF_BUCKETS; ++b) {
+    seen += hist[b];
+    if (seen * 100 >= n * 99)
+      break;
+  }
+  return b == 0 ? 0 : 1ULL << b;
+}
+
+/* Prints every named lock. Read without locking, so counts may be torn
+   between threads. */
+void lockprof_dump(FILE *out) {
+  lock_stats *st;
+  unsigned long holds;
+  int n, b;
+  for (n = 0; n < num_names; ++n) {
+    st = &names[n];
+    if (st->acquired == 0)
+      continue;
+    /* Condition waits split a hold in two */
+    for (b = 0, holds = 0; b < LOCKPROF_BUCKETS; ++b)
+      holds += st->hold_hist[b];
+    if (holds == 0)
+      holds = 1;
+    fprintf(out, "Lock %s: %lu acquired, %lu contended (%.1f%%), wait mean %luns "
+      "p99 < %luns max %luns, hold mean %luns p99 < %luns max %luns\n",
+      st->name, st->acquired, st->contended, 100.0 * st->contended / st->acquired,
+      (unsigned long)(st->wait_ns / st->acquired),
+      (unsigned long)p99(st->wait_hist, st->acquired), (unsigned long)st->max_wait_ns,
+      (unsigned long)(st->hold_ns / holds),
+      (unsigned long)p99(st->hold_hist, holds), (unsigned long)st->max_hold_ns);
+  }
+}
+#endif
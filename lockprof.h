@@ -0,0 +1,31 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+/* Built with -DLOCK_PROFILE, the mutexes named with LOCK_NAME() count
+   their acquisitions and how long threads waited for and held them, see
+   lockprof_dump(). Mutexes of the same name are counted together. The
+   pthread calls below are redirected for every file including this. */
+#ifdef LOCK_PROFILE
+#define LOCKPROF_SLOTS 256   /* Named mutexes */
+#define LOCKPROF_NAMES 32
+#define LOCKPROF_BUCKETS 32  /* log2 nanosecond histograms */
+
+void lockprof_name(pthread_mutex_t *m, const char *name);
+int lockprof_lock(pthread_mutex_t *m);
+int lockprof_unlock(pthread_mutex_t *m);
+int lockprof_cond_wait(pthread_cond_t *c, pthread_mutex_t *m);
+void lockprof_dump(FILE *out);
+
+#define LOCK_NAME(m,name) lockprof_name(m, name)
+#define pthread_mutex_lock(m) lockprof_lock(m)
+#define pthread_mutex_unlock(m) lockprof_unlock(m)
+#define pthread_cond_wait(c,m) lockprof_cond_wait(c, m)
+#else
+#define LOCK_NAME(m,name) ((void)0)
+#define lockprof_dump(out) ((void)0)
+#endif
+
+#endif
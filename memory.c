@@ -1,7 +1,145 @@
 #include "memory.h"
 
-void *emalloc(size_t size) {
-  void *p = malloc(size);
+#ifdef MEM_PROFILE
+#include <stdint.h>
+
+/* Each block starts with a header naming the site that allocated it, so
+   frees are counted against that site */
+typedef struct _mem_header {
+  unsigned int site;
+  size_t size;
+} mem_header;
+
+typedef struct _mem_site {
+  const char *file;
+  int line;
+  unsigned long count;   /* Allocations */
+  unsigned long frees;
+  size_t bytes;          /* Allocated in total */
+  size_t live;
+  size_t peak;           /* Most live at once */
+} mem_site;
+
+static mem_site sites[MEM_PROFILE_SITES]; /* The last one takes overflow */
+static unsigned long total_count;
+static size_t total_bytes, total_live, total_peak;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Expects prof_lock to be held */
+static unsigned int site_of(const char *file, int line) {
+  unsigned int h = (unsigned int)line, i;
+  const char *c;
+  for (c = file; *c; ++c)
+    h = h * 31 + (unsigned char)*c;
+  h %= MEM_PROFILE_SITES - 1;
+  for (i = 0; i < MEM_PROFILE_SITES - 1; ++i, h = (h + 1) % (MEM_PROFILE_SITES - 1)) {
+    if (!sites[h].file) {
+      sites[h].file = file;
+      sites[h].line = line;
+      return h;
+    }
+    if (sites[h].line == line && strcmp(sites[h].file, file) == 0)
+      return h;
+  }
+  return MEM_PROFILE_SITES - 1;
+}
+
+/* Expects prof_lock to be held */
+static void count_alloc(mem_header *h, size_t size, const char *file, int line) {
+  mem_site *s;
+  h->site = site_of(file, line);
+  h->size = size;
+  s = &sites[h->site];
+  ++s->count;
+  s->bytes += size;
+  s->live += size;
+  if (s->live > s->peak)
+    s->peak = s->live;
+  ++total_count;
+  total_bytes += size;
+  total_live += size;
+  if (total_live > total_peak)
+    total_peak = total_live;
+}
+
+/* Expects prof_lock to be held */
+static void count_free(mem_header *h) {
+  ++sites[h->site].frees;
+  sites[h->site].live -= h->size;
+  total_live -= h->size;
+}
+
+static void *mem_alloc(size_t size, const char *file, int line) {
+  mem_header *h = (mem_header *)malloc(MEM_ALIGN + size);
+  if (!h)
+    return NULL;
+  pthread_mutex_lock(&prof_lock);
+  count_alloc(h, size, file, line);
+  pthread_mutex_unlock(&prof_lock);
+  return (char *)h + MEM_ALIGN;
+}
+
+static void mem_release(void *ptr) {
+  mem_header *h;
+  if (!ptr)
+    return;
+  h = (mem_header *)((char *)ptr - MEM_ALIGN);
+  pthread_mutex_lock(&prof_lock);
+  count_free(h);
+  pthread_mutex_unlock(&prof_lock);
+  free(h);
+}
+
+/* A resize counts as a free of the old block and an allocation at the
+   site that resized it */
+static void *mem_resize(void *ptr, size_t size, const char *file, int line) {
+  mem_header *h = (mem_header *)((char *)ptr - MEM_ALIGN), old = *h;
+  if (!(h = (mem_header *)realloc(h, MEM_ALIGN + size)))
+    return NULL;
+  pthread_mutex_lock(&prof_lock);
+  count_free(&old);
+  count_alloc(h, size, file, line);
+  pthread_mutex_unlock(&prof_lock);
+  return (char *)h + MEM_ALIGN;
+}
+
+static int by_count(const void *a, const void *b) {
+  const mem_site *x = (const mem_site *)a, *y = (const mem_site *)b;
+  return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+/* Prints the allocation counts of every call site, busiest first, from a
+   snapshot taken under the lock */
+void mem_profile_dump(FILE *out) {
+  static mem_site copy[MEM_PROFILE_SITES];
+  unsigned long count;
+  size_t bytes, live, peak;
+  int i, n = 0;
+  pthread_mutex_lock(&prof_lock);
+  for (i = 0; i < MEM_PROFILE_SITES; ++i)
+    if (sites[i].count > 0)
+      copy[n++] = sites[i];
+  count = total_count;
+  bytes = total_bytes;
+  live = total_live;
+  peak = total_peak;
+  pthread_mutex_unlock(&prof_lock);
+  qsort(copy, n, sizeof(mem_site), by_count);
+  fprintf(out, "Allocations: %lu (%zu bytes), %zu bytes live, peak %zu.\n",
+    count, bytes, live, peak);
+  for (i = 0; i < n; ++i)
+    fprintf(out, "  %s:%d: %lu allocs, %lu frees, %zu bytes, %zu live, peak %zu\n",
+      copy[i].file ? copy[i].file : "(other)", copy[i].line, copy[i].count,
+      copy[i].frees, copy[i].bytes, copy[i].live, copy[i].peak);
+}
+#else
+#define mem_alloc(size) malloc(size)
+#define mem_release(ptr) free(ptr)
+#define mem_resize(ptr,size) realloc(ptr, size)
+#endif
+
+void *(emalloc)(size_t size MEM_SITE_DECL) {
+  void *p = mem_alloc(size MEM_SITE_PASS);
   if (!p) {
     fprintf(stderr,"FATAL:  emalloc():  Unable to allocate %ld bytes\n", (long) size);
     exit(1);
@@ -9,20 +147,20 @@ void *emalloc(size_t size) {
   return p;
 }
 void efree(void *ptr) {
-  free(ptr);
+  mem_release(ptr);
 }
-void *ecalloc(size_t nmemb, size_t size) {
+void *(ecalloc)(size_t nmemb, size_t size MEM_SITE_DECL) {
   void *p;
   int final_size = size*nmemb;
-  p = emalloc(final_size);
+  p = (emalloc)(final_size MEM_SITE_PASS);
   memset(p, 0, final_size);
   return p;
 }
-void *erealloc(void *ptr, size_t size) {
+void *(erealloc)(void *ptr, size_t size MEM_SITE_DECL) {
   if (!ptr) {
-    return emalloc(size);
+    return (emalloc)(size MEM_SITE_PASS);
   }
-  void *p = realloc(ptr, size);
+  void *p = mem_resize(ptr, size MEM_SITE_PASS);
   if (!p) {
     fprintf(stderr,"FATAL:  erealloc():  Unable to allocate %ld bytes\n", (long) size);
     efree(ptr);
@@ -30,20 +168,131 @@ void *erealloc(void *ptr, size_t size) {
   }
   return p;
 }
-char *estrdup(const char *s) {
+char *(estrdup)(const char *s MEM_SITE_DECL) {
   int length;
   char *p;
   
   length = strlen(s)+1;
-  p = (char *) emalloc(length);
+  p = (char *) (emalloc)(length MEM_SITE_PASS);
   memcpy(p, s, length);
   return p;
 }
-char *estrndup(const char *s, unsigned int length) {
+char *(estrndup)(const char *s, unsigned int length MEM_SITE_DECL) {
   char *p;
   
-  p = (char *) emalloc(length+1);
+  p = (char *) (emalloc)(length+1 MEM_SITE_PASS);
   memcpy(p,s,length);
   p[length] = 0;
   return p;
 }
+
+#define ROUND_UP(n) (((n) + MEM_ALIGN - 1) & ~(size_t)(MEM_ALIGN - 1))
+
+void mempool_init(mempool_t *p, size_t size, size_t per_slab) {
+  p->size = ROUND_UP(size > sizeof(void *) ? size : sizeof(void *));
+  p->per_slab = per_slab > 0 ? per_slab : MEMPOOL_SLAB;
+  p->free = NULL;
+  p->slabs = NULL;
+  p->live = 0;
+  p->capacity = 0;
+  pthread_mutex_init(&p->lock, NULL);
+  LOCK_NAME(&p->lock, "mempool.lock");
+}
+
+void *(mempool_get)(mempool_t *p MEM_SITE_DECL) {
+  char *slab, *obj;
+  size_t i;
+  pthread_mutex_lock(&p->lock);
+  if (!p->free) {
+    /* The slab's link takes the first MEM_ALIGN bytes */
+    slab = (char *)(emalloc)(MEM_ALIGN + p->per_slab * p->size MEM_SITE_PASS);
+    *(void **)slab = p->slabs;
+    p->slabs = slab;
+    for (i = p->per_slab; i > 0; --i) {
+      obj = slab + MEM_ALIGN + (i - 1) * p->size;
+      *(void **)obj = p->free;
+      p->free = obj;
+    }
+    p->capacity += p->per_slab;
+  }
+  obj = (char *)p->free;
+  p->free = *(void **)obj;
+  ++p->live;
+  pthread_mutex_unlock(&p->lock);
+  return obj;
+}
+
+void mempool_put(mempool_t *p, void *obj) {
+  pthread_mutex_lock(&p->lock);
+  *(void **)obj = p->free;
+  p->free = obj;
+  --p->live;
+  pthread_mutex_unlock(&p->lock);
+}
+
+void mempool_destroy(mempool_t *p) {
+  void *slab;
+  while ((slab = p->slabs) != NULL) {
+    p->slabs = *(void **)slab;
+    efree(slab);
+  }
+  p->free = NULL;
+  p->live = 0;
+  p->capacity = 0;
+  pthread_mutex_destroy(&p->lock);
+}
+
+void (arena_init)(arena_t *a, size_t size MEM_SITE_DECL) {
+  a->size = ROUND_UP(size > 0 ? size : MEM_ALIGN);
+  a->base = (char *)(emalloc)(a->size MEM_SITE_PASS);
+  a->used = 0;
+  a->spilled = 0;
+  a->overflow = NULL;
+}
+
+void *(arena_alloc)(arena_t *a, size_t n MEM_SITE_DECL) {
+  char *block;
+  n = ROUND_UP(n > 0 ? n : 1);
+  if (a->size - a->used >= n) {
+    block = a->base + a->used;
+    a->used += n;
+    return block;
+  }
+  block = (char *)(emalloc)(MEM_ALIGN + n MEM_SITE_PASS);
+  *(void **)block = a->overflow;
+  a->overflow = block;
+  a->spilled += n;
+  return block + MEM_ALIGN;
+}
+
+char *(arena_strndup)(arena_t *a, const char *s, size_t length MEM_SITE_DECL) {
+  char *p = (char *)(arena_alloc)(a, length + 1 MEM_SITE_PASS);
+  memcpy(p, s, length);
+  p[length] = 0;
+  return p;
+}
+
+void (arena_reset)(arena_t *a MEM_SITE_DECL) {
+  void *block;
+  if (a->overflow) {
+    while ((block = a->overflow) != NULL) {
+      a->overflow = *(void **)block;
+      efree(block);
+    }
+    efree(a->base);
+    a->size = ROUND_UP(a->size + a->spilled);
+    a->base = (char *)(emalloc)(a->size MEM_SITE_PASS);
+    a->spilled = 0;
+  }
+  a->used = 0;
+}
+
+void arena_destroy(arena_t *a) {
+  void *block;
+  while ((block = a->overflow) != NULL) {
+    a->overflow = *(void **)block;
+    efree(block);
+  }
+  efree(a->base);
+  a->base = NULL;
+}
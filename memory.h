@@ -4,15 +4,87 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include "lockprof.h"
 
 #define ALLOC_N(type,n) (type*)emalloc(sizeof(type)*(n))
 #define ALLOC(type) (type*)emalloc(sizeof(type))
 
-void *emalloc(size_t size);
+/* Built with -DMEM_PROFILE every heap allocation is counted against the
+   file and line that asked for it, see mem_profile_dump(). Functions that
+   may allocate take the call site as extra arguments, which the macros
+   at the end of this file fill in. */
+#ifdef MEM_PROFILE
+#define MEM_SITE_DECL , const char *file, int line
+#define MEM_SITE_PASS , file, line
+#define MEM_PROFILE_SITES 1024
+#else
+#define MEM_SITE_DECL
+#define MEM_SITE_PASS
+#endif
+
+#define MEM_ALIGN 16    /* Alignment of pool objects and arena allocations */
+#define MEMPOOL_SLAB 64 /* Objects carved from each slab */
+
+/* Thread safe pool of fixed size objects. Objects put back are handed out
+   again before new slabs are allocated, and slabs are only freed with the
+   pool, so a steady number of live objects costs no heap allocations. */
+typedef struct _mempool {
+  size_t size;
+  size_t per_slab;
+  void *free;   /* Objects put back, linked through their first word */
+  void *slabs;  /* Linked through their first word */
+  unsigned long live, capacity;
+  pthread_mutex_t lock;
+} mempool_t;
+
+#define POOL_INIT(pool,type) mempool_init(pool, sizeof(type), MEMPOOL_SLAB)
+#define POOL_GET(pool,type) (type*)mempool_get(pool)
+
+void mempool_init(mempool_t *p, size_t size, size_t per_slab);
+void *mempool_get(mempool_t *p MEM_SITE_DECL);
+void mempool_put(mempool_t *p, void *obj);
+void mempool_destroy(mempool_t *p);
+
+/* Bump allocator for data that lives until the next arena_reset(). Not
+   thread safe. Allocations past its size come from overflow blocks, and
+   the reset after them grows the arena to fit, so a repeating workload
+   stops allocating after its first round. */
+typedef struct _arena {
+  char *base;
+  size_t size;
+  size_t used;
+  size_t spilled;  /* Bytes in overflow blocks since the last reset */
+  void *overflow;  /* Linked through their first word */
+} arena_t;
+
+void arena_init(arena_t *a, size_t size MEM_SITE_DECL);
+void *arena_alloc(arena_t *a, size_t n MEM_SITE_DECL);
+char *arena_strndup(arena_t *a, const char *s, size_t length MEM_SITE_DECL);
+void arena_reset(arena_t *a MEM_SITE_DECL);
+void arena_destroy(arena_t *a);
+
+void *emalloc(size_t size MEM_SITE_DECL);
 void efree(void *ptr);
-void *ecalloc(size_t nmemb, size_t size);
-void *erealloc(void *ptr, size_t size);
-char *estrdup(const char *s);
-char *estrndup(const char *s, unsigned int length);
+void *ecalloc(size_t nmemb, size_t size MEM_SITE_DECL);
+void *erealloc(void *ptr, size_t size MEM_SITE_DECL);
+char *estrdup(const char *s MEM_SITE_DECL);
+char *estrndup(const char *s, unsigned int length MEM_SITE_DECL);
+
+#ifdef MEM_PROFILE
+void mem_profile_dump(FILE *out);
+#define emalloc(size) emalloc(size, __FILE__, __LINE__)
+#define ecalloc(nmemb,size) ecalloc(nmemb, size, __FILE__, __LINE__)
+#define erealloc(ptr,size) erealloc(ptr, size, __FILE__, __LINE__)
+#define estrdup(s) estrdup(s, __FILE__, __LINE__)
+#define estrndup(s,length) estrndup(s, length, __FILE__, __LINE__)
+#define mempool_get(p) mempool_get(p, __FILE__, __LINE__)
+#define arena_init(a,size) arena_init(a, size, __FILE__, __LINE__)
+#define arena_alloc(a,n) arena_alloc(a, n, __FILE__, __LINE__)
+#define arena_strndup(a,s,length) arena_strndup(a, s, length, __FILE__, __LINE__)
+#define arena_reset(a) arena_reset(a, __FILE__, __LINE__)
+#else
+#define mem_profile_dump(out) ((void)0)
+#endif
 
 #endif
@@ -0,0 +1,117 @@
+#include "metrics.h"
+
+static slot_registry shards = SLOT_REGISTRY_INIT(metrics_shard_t, METRICS_LINE);
+static __thread slot_t *self;
+
+static const char *counter_names[M_COUNTERS] = {
+  "imgserver_connections_total",
+  "imgserver_requests_total",
+  "imgserver_sent_bytes_total",
+  "imgserver_errors_total{kind=\"bad_request\"}",
+  "imgserver_errors_total{kind=\"not_found\"}",
+  "imgserver_errors_total{kind=\"is_directory\"}",
+  "imgserver_errors_total{kind=\"open\"}",
+  "imgserver_errors_total{kind=\"recv\"}",
+  "imgserver_errors_total{kind=\"send\"}",
+  "imgserver_errors_total{kind=\"rejected\"}",
+};
+
+static const char *hist_names[M_HISTS] = {
+  "imgserver_lookup_seconds",
+  "imgserver_open_seconds",
+  "imgserver_fstat_seconds",
+  "imgserver_send_seconds",
+  "imgserver_executor_wait_seconds",
+  "imgserver_adaptive_wait_seconds",
+  "imgserver_adaptive_wait_seconds",
+  "imgserver_adaptive_wait_seconds",
+};
+
+static const char *hist_labels[M_HISTS] = {
+  "", "", "", "", "", "class=\"high\",", "class=\"med\",", "class=\"low\","
+};
+
+/* The calling thread's shard, claimed or made on its first record */
+static metrics_shard_t *metrics_self(void) {
+  return (metrics_shard_t *)(self ? self : slot_claim(&shards, &self));
+}
+
+void metrics_add(int c, uint64_t n) {
+  metrics_shard_t *s = metrics_self();
+  __atomic_store_n(&s->counter[c], s->counter[c] + n, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(int h, uint64_t us) {
+  metrics_hist_t *hist = &metrics_self()->hist[h];
+  int b = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1); /* le is inclusive */
+  if (b >= METRICS_BUCKETS)
+    b = METRICS_BUCKETS - 1;
+  __atomic_store_n(&hist->bucket[b], hist->bucket[b] + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&hist->sum_us, hist->sum_us + us, __ATOMIC_RELAXED);
+  __atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELAXED);
+}
+
+/* Observes the microseconds since start, a metrics_now_ns() reading */
+void metrics_since(int h, uint64_t start) {
+  uint64_t now = metrics_now_ns();
+  metrics_observe(h, now > start ? (now - start) / 1000 : 0);
+}
+
+uint64_t metrics_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Sums every shard into m. Shards are only ever added, so the walk needs
+   no lock; counts recorded while it runs may or may not be included. */
+void metrics_collect(metrics_t *m) {
+  metrics_shard_t *s;
+  slot_t *sl;
+  int i, b;
+  memset(m, 0, sizeof *m);
+  for (sl = slot_first(&shards); sl; sl = sl->next) {
+    s = (metrics_shard_t *)sl;
+    for (i = 0; i < M_COUNTERS; ++i)
+      m->counter[i] += __atomic_load_n(&s->counter[i], __ATOMIC_RELAXED);
+    for (i = 0; i < M_HISTS; ++i) {
+      m->hist[i].count += __atomic_load_n(&s->hist[i].count, __ATOMIC_RELAXED);
+      m->hist[i].sum_us += __atomic_load_n(&s->hist[i].sum_us, __ATOMIC_RELAXED);
+      for (b = 0; b < METRICS_BUCKETS; ++b)
+        m->hist[i].bucket[b] += __atomic_load_n(&s->hist[i].bucket[b], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* Prints m in the Prometheus text format */
+void metrics_print(FILE *out, const metrics_t *m) {
+  const metrics_hist_t *h;
+  uint64_t seen;
+  int i, b;
+  for (i = 0; i < M_COUNTERS; ++i) {
+    if (i <= M_ERR_BAD_REQUEST)
+      fprintf(out, "# TYPE %.*s counter\n",
+        (int)strcspn(counter_names[i], "{"), counter_names[i]);
+    fprintf(out, "%s %llu\n", counter_names[i], (unsigned long long)m->counter[i]);
+  }
+  for (i = 0; i < M_HISTS; ++i) {
+    h = &m->hist[i];
+    if (i <= M_ADP_WAIT_US)
+      fprintf(out, "# TYPE %s histogram\n", hist_names[i]);
+    for (b = 0, seen = 0; b < METRICS_BUCKETS - 1; ++b) {
+      seen += h->bucket[b];
+      fprintf(out, "%s_bucket{%sle=\"%g\"} %llu\n", hist_names[i], hist_labels[i],
+        (double)(1ULL << b) / 1e6, (unsigned long long)seen);
+    }
+    fprintf(out, "%s_bucket{%sle=\"+Inf\"} %llu\n", hist_names[i], hist_labels[i],
+      (unsigned long long)h->count);
+    if (hist_labels[i][0])
+      fprintf(out, "%s_sum{%.*s} %g\n%s_count{%.*s} %llu\n",
+        hist_names[i], (int)strlen(hist_labels[i]) - 1, hist_labels[i], h->sum_us / 1e6,
+        hist_names[i], (int)strlen(hist_labels[i]) - 1, hist_labels[i],
+        (unsigned long long)h->count);
+    else
+      fprintf(out, "%s_sum %g\n%s_count %llu\n", hist_names[i], h->sum_us / 1e6,
+        hist_names[i], (unsigned long long)h->count);
+  }
+}
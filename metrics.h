@@ -0,0 +1,68 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "memory.h"
+#include "slots.h"
+
+#define METRICS_LINE 64    /* Shards never share a cache line */
+#define METRICS_BUCKETS 32 /* log2 microsecond histograms */
+
+/* Counters, summed over every thread when read */
+enum {
+  M_CONNECTIONS,
+  M_REQUESTS,
+  M_BYTES_SENT,      /* Of bodies, not response lines */
+  M_ERR_BAD_REQUEST, /* Malformed lines, invalid ranges and validators */
+  M_ERR_NOT_FOUND,   /* Not in the image index */
+  M_ERR_IS_DIR,      /* Indexed, but a directory by the time it was opened */
+  M_ERR_OPEN,
+  M_ERR_RECV,
+  M_ERR_SEND,
+  M_ERR_REJECTED,    /* Turned away or dropped from the executor queue */
+  M_COUNTERS
+};
+
+/* Latency histograms, in microseconds */
+enum {
+  M_LOOKUP_US,   /* Index lookup, found or not */
+  M_OPEN_US,
+  M_FSTAT_US,    /* Of the open file, for the size and validator sent */
+  M_SEND_US,     /* One sendfile, send or splice of the body */
+  M_EXEC_WAIT_US, /* Executor queue wait */
+  M_ADP_WAIT_US, /* One per adaptive class, high first */
+  M_HISTS = M_ADP_WAIT_US + 3
+};
+
+typedef struct _metrics_hist {
+  uint64_t count;
+  uint64_t sum_us;
+  uint64_t bucket[METRICS_BUCKETS]; /* bucket[b] counts values up to 2^b, above 2^(b-1) */
+} metrics_hist_t;
+
+/* One thread's counts, kept in a slot registry. Only the owner writes
+   them, with relaxed atomics so that readers summing all shards never see
+   torn values. */
+typedef struct _metrics_shard {
+  slot_t slot;
+  uint64_t counter[M_COUNTERS];
+  metrics_hist_t hist[M_HISTS];
+} __attribute__((aligned(METRICS_LINE))) metrics_shard_t;
+
+/* A snapshot summed over every shard */
+typedef struct _metrics {
+  uint64_t counter[M_COUNTERS];
+  metrics_hist_t hist[M_HISTS];
+} metrics_t;
+
+void metrics_add(int c, uint64_t n);
+void metrics_observe(int h, uint64_t us);
+void metrics_since(int h, uint64_t start);
+uint64_t metrics_now_ns(void);
+void metrics_collect(metrics_t *m);
+void metrics_print(FILE *out, const metrics_t *m);
+
+#endif
@@ -0,0 +1,71 @@
+#include "mpmcq.h"
+
+#define CELL_SEQ(q, pos) ((uint64_t *)((q)->cells + ((pos) % (q)->capacity) * (q)->stride))
+
+void mpmcq_init(mpmcq_t *q, uint64_t capacity, size_t elem) {
+  uint64_t i;
+  q->head = 0;
+  q->tail = 0;
+  q->elem = elem;
+  q->stride = (sizeof(uint64_t) + elem + 7) & ~(size_t)7;
+  q->capacity = capacity > 0 ? capacity : 1;
+  q->cells = (char *)emalloc(q->capacity * q->stride);
+  for (i = 0; i < q->capacity; ++i)
+    *CELL_SEQ(q, i) = i;
+}
+
+void mpmcq_destroy(mpmcq_t *q) {
+  efree(q->cells);
+  q->cells = NULL;
+}
+
+/* Returns -1 when the queue is full */
+int mpmcq_push(mpmcq_t *q, const void *e) {
+  uint64_t pos, seq, *cell;
+  pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  for (;;) {
+    cell = CELL_SEQ(q, pos);
+    seq = __atomic_load_n(cell, __ATOMIC_ACQUIRE);
+    if (seq == pos) {
+      if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if ((int64_t)(seq - pos) < 0) {
+      return -1; /* Still holds the element from a lap ago */
+    } else {
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+  }
+  memcpy(cell + 1, e, q->elem);
+  __atomic_store_n(cell, pos + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Returns -1 when the queue is empty */
+int mpmcq_pop(mpmcq_t *q, void *e) {
+  uint64_t pos, seq, *cell;
+  pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  for (;;) {
+    cell = CELL_SEQ(q, pos);
+    seq = __atomic_load_n(cell, __ATOMIC_ACQUIRE);
+    if (seq == pos + 1) {
+      if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if ((int64_t)(seq - (pos + 1)) < 0) {
+      return -1; /* Not yet written */
+    } else {
+      pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    }
+  }
+  memcpy(e, cell + 1, q->elem);
+  __atomic_store_n(cell, pos + q->capacity, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Elements queued, possibly stale by the time it returns */
+uint64_t mpmcq_length(mpmcq_t *q) {
+  uint64_t head = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST);
+  uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+  return tail > head ? tail - head : 0;
+}
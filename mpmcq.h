@@ -0,0 +1,30 @@
+#ifndef MPMCQ_H
+#define MPMCQ_H
+
+#include <stdint.h>
+#include <string.h>
+#include "memory.h"
+
+#define MPMCQ_LINE 64 /* Keeps the two ends on separate cache lines */
+
+/* Bounded multi-producer multi-consumer queue of fixed size elements.
+   Each cell carries a sequence number telling whether it is free for the
+   enqueue at that position or holds the element for the dequeue there. */
+typedef struct _mpmcq {
+  uint64_t tail;   /* Next position to enqueue */
+  char pad1[MPMCQ_LINE - sizeof(uint64_t)];
+  uint64_t head;   /* Next position to dequeue */
+  char pad2[MPMCQ_LINE - sizeof(uint64_t)];
+  char *cells;
+  size_t stride;
+  size_t elem;
+  uint64_t capacity;
+} mpmcq_t;
+
+void mpmcq_init(mpmcq_t *q, uint64_t capacity, size_t elem);
+void mpmcq_destroy(mpmcq_t *q);
+int mpmcq_push(mpmcq_t *q, const void *e);
+int mpmcq_pop(mpmcq_t *q, void *e);
+uint64_t mpmcq_length(mpmcq_t *q);
+
+#endif
@@ -0,0 +1,55 @@
+#include "pacing.h"
+
+void tbucket_init(tbucket_t *b, uint64_t rate, uint64_t burst) {
+  b->rate = rate;
+  b->burst = burst > 0 ? burst : PACE_QUANTUM;
+  b->tokens = (double)b->burst;
+  clock_gettime(CLOCK_MONOTONIC, &b->last);
+}
+
+/* Grants up to want bytes from the bucket. Returns 0 when fewer than a
+   quantum (or want, if smaller) is available, with the time until there
+   will be in wait_ns. */
+size_t tbucket_take(tbucket_t *b, size_t want, long *wait_ns) {
+  struct timespec now;
+  double need;
+  size_t n;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  b->tokens += b->rate * ((now.tv_sec - b->last.tv_sec) +
+    (now.tv_nsec - b->last.tv_nsec) / 1e9);
+  if (b->tokens > b->burst)
+    b->tokens = b->burst;
+  b->last = now;
+  need = want < PACE_QUANTUM ? want : PACE_QUANTUM;
+  if (need > b->burst)
+    need = b->burst;
+  if (b->tokens < need) {
+    *wait_ns = (long)((need - b->tokens) * 1e9 / b->rate) + 1;
+    return 0;
+  }
+  n = want < b->tokens ? want : (size_t)b->tokens;
+  b->tokens -= n;
+  return n;
+}
+
+/* Puts back tokens taken but not used */
+void tbucket_refund(tbucket_t *b, size_t n) {
+  b->tokens += n;
+  if (b->tokens > b->burst)
+    b->tokens = b->burst;
+}
+
+/* Caps the socket at rate bytes/sec in the kernel, 0 lifting the cap */
+int pacing_set(int sockfd, uint64_t rate) {
+  unsigned int r = (rate == 0 || rate > ~0U) ? ~0U : (unsigned int)rate;
+  return setsockopt(sockfd, SOL_SOCKET, SO_MAX_PACING_RATE, &r, sizeof r);
+}
+
+void timespec_add_ns(struct timespec *t, long ns) {
+  t->tv_sec += ns / 1000000000L;
+  t->tv_nsec += ns % 1000000000L;
+  if (t->tv_nsec >= 1000000000L) {
+    ++t->tv_sec;
+    t->tv_nsec -= 1000000000L;
+  }
+}
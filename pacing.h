@@ -0,0 +1,29 @@
+#ifndef PACING_H
+#define PACING_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE 47
+#endif
+
+#define PACE_QUANTUM 16384 /* Smallest grant worth a send while paced */
+
+/* Token bucket, refilled at rate bytes/sec up to burst bytes */
+typedef struct _tbucket {
+  uint64_t rate;
+  uint64_t burst;
+  double tokens;
+  struct timespec last;
+} tbucket_t;
+
+void tbucket_init(tbucket_t *b, uint64_t rate, uint64_t burst);
+size_t tbucket_take(tbucket_t *b, size_t want, long *wait_ns);
+void tbucket_refund(tbucket_t *b, size_t n);
+int pacing_set(int sockfd, uint64_t rate);
+void timespec_add_ns(struct timespec *t, long ns);
+
+#endif
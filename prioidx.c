@@ -0,0 +1,150 @@
+#include "prioidx.h"
+
+#define SIZE(t) ((t) ? (t)->size : 0)
+
+static int before(const prionode *a, const prionode *b) {
+  return a->speed < b->speed || (a->speed == b->speed && a->seq < b->seq);
+}
+
+static void resize(prionode *t) {
+  t->size = SIZE(t->left) + 1 + SIZE(t->right);
+}
+
+static prionode *merge(prionode *l, prionode *r) {
+  if (!l)
+    return r;
+  if (!r)
+    return l;
+  if (l->heap > r->heap) {
+    l->right = merge(l->right, r);
+    resize(l);
+    return l;
+  }
+  r->left = merge(l, r->left);
+  resize(r);
+  return r;
+}
+
+/* Splits t into the nodes ordered before n and the rest */
+static void split(prionode *t, const prionode *n, prionode **l, prionode **r) {
+  if (!t) {
+    *l = *r = NULL;
+  } else if (before(t, n)) {
+    split(t->right, n, &t->right, r);
+    resize(t);
+    *l = t;
+  } else {
+    split(t->left, n, l, &t->left);
+    resize(t);
+    *r = t;
+  }
+}
+
+static prionode *erase(prionode *t, const prionode *n) {
+  if (t == n)
+    return merge(t->left, t->right);
+  if (before(n, t))
+    t->left = erase(t->left, n);
+  else
+    t->right = erase(t->right, n);
+  resize(t);
+  return t;
+}
+
+static void insert(prioidx_t *idx, prionode *n) {
+  prionode *l, *r;
+  n->left = n->right = NULL;
+  n->size = 1;
+  split(idx->root, n, &l, &r);
+  idx->root = merge(merge(l, n), r);
+}
+
+static prionode **find(prioidx_t *idx, int cid) {
+  prionode **p;
+  for (p = &idx->buckets[(unsigned int)cid % idx->nbuckets]; *p; p = &(*p)->hnext) {
+    if ((*p)->cid == cid)
+      break;
+  }
+  return p;
+}
+
+static void rehash(prioidx_t *idx) {
+  prionode **old = idx->buckets, *p, *next;
+  size_t i, n = idx->nbuckets;
+  idx->nbuckets = n * 2;
+  idx->buckets = (prionode **)ecalloc(idx->nbuckets, sizeof(prionode *));
+  for (i = 0; i < n; ++i) {
+    for (p = old[i]; p; p = next) {
+      next = p->hnext;
+      p->hnext = idx->buckets[(unsigned int)p->cid % idx->nbuckets];
+      idx->buckets[(unsigned int)p->cid % idx->nbuckets] = p;
+    }
+  }
+  efree(old);
+}
+
+void prioidx_init(prioidx_t *idx) {
+  idx->root = NULL;
+  idx->nbuckets = PRIOIDX_MIN_BUCKETS;
+  idx->buckets = (prionode **)ecalloc(idx->nbuckets, sizeof(prionode *));
+  idx->count = 0;
+  idx->seq = 0;
+  idx->rng = 2463534242U;
+  POOL_INIT(&idx->nodes, prionode);
+}
+
+/* Sets the speed of cid, adding it if new. A client that changes speed is
+   ordered after those already at that speed. */
+void prioidx_update(prioidx_t *idx, int cid, int speed) {
+  prionode **p = find(idx, cid), *n = *p;
+  if (n) {
+    if (n->speed == speed)
+      return;
+    idx->root = erase(idx->root, n);
+  } else {
+    if ((size_t)idx->count + 1 > idx->nbuckets) {
+      rehash(idx);
+      p = find(idx, cid);
+    }
+    n = POOL_GET(&idx->nodes, prionode);
+    n->cid = cid;
+    n->hnext = NULL;
+    *p = n;
+    idx->rng ^= idx->rng << 13; /* xorshift32 */
+    idx->rng ^= idx->rng >> 17;
+    idx->rng ^= idx->rng << 5;
+    n->heap = idx->rng;
+    ++idx->count;
+  }
+  n->speed = speed;
+  n->seq = idx->seq++;
+  insert(idx, n);
+}
+
+int prioidx_remove(prioidx_t *idx, int cid) {
+  prionode **p = find(idx, cid), *n = *p;
+  if (!n)
+    return -1;
+  *p = n->hnext;
+  idx->root = erase(idx->root, n);
+  --idx->count;
+  mempool_put(&idx->nodes, n);
+  return 0;
+}
+
+/* Position of cid from the slowest client, -1 if unknown */
+int prioidx_rank(prioidx_t *idx, int cid) {
+  prionode *n = *find(idx, cid), *t = idx->root;
+  int rank = 0;
+  if (!n)
+    return -1;
+  while (t != n) {
+    if (before(n, t)) {
+      t = t->left;
+    } else {
+      rank += SIZE(t->left) + 1;
+      t = t->right;
+    }
+  }
+  return rank + SIZE(n->left);
+}
@@ -0,0 +1,39 @@
+#ifndef PRIOIDX_H
+#define PRIOIDX_H
+
+#include <stdio.h>
+#include <string.h>
+#include "memory.h"
+
+#define PRIOIDX_MIN_BUCKETS 64
+
+/* A client ordered by speed, ties broken by when it took that speed */
+typedef struct _prionode {
+  int cid;
+  int speed;
+  unsigned long seq;
+  unsigned int heap;  /* Random treap priority */
+  int size;           /* Nodes in this subtree */
+  struct _prionode *left;
+  struct _prionode *right;
+  struct _prionode *hnext; /* cid hash chain */
+} prionode;
+
+/* Order statistics treap plus a cid hash, so update, remove and rank
+   are all expected O(log n). Not thread safe. */
+typedef struct _prioidx {
+  prionode *root;
+  prionode **buckets;
+  size_t nbuckets;
+  mempool_t nodes;
+  int count;
+  unsigned long seq;
+  unsigned int rng;
+} prioidx_t;
+
+void prioidx_init(prioidx_t *idx);
+void prioidx_update(prioidx_t *idx, int cid, int speed);
+int prioidx_remove(prioidx_t *idx, int cid);
+int prioidx_rank(prioidx_t *idx, int cid);
+
+#endif
@@ -7,17 +7,42 @@ const char *program_name;
 static const char *image_dir;
 static int sockfd;
 static int verbose_f;
+static int event_f;
+static int uring_f;
+static int cache_f;
+static cache_t cache;
+static imgindex_t images;
+static mempool_t clientinfo_pool;
+static mempool_t urconn_pool;
+static mempool_t cli_evt_pool;
+static int pace_f;
+static int pace_sw;          /* Token buckets instead of SO_MAX_PACING_RATE, set once by any thread */
+static uint64_t pace_rate;   /* Bytes/sec per connection, 0 for unpaced */
+static uint64_t pace_burst;
+static uint64_t class_rate[3]; /* Per adaptive class, 0 falls back to pace_rate */
 
 static int adaptive_f;
 static pthread_t adaptive_tid;
 static int atid_v;
 static int adaptivefd;
 static int adaptiveport;
+static int metricsfd = -1;
+static int trace_f;
+static pthread_t metrics_tid;
+static int stats_pipe[2] = {-1, -1}; /* SIGUSR1 to the stats thread */
 prioritylocks adaptive_d;
+static pthread_condattr_t adp_condattr; /* Waits timed on CLOCK_MONOTONIC */
 
 static void global_exit(int status);
-static void unexpectMe();
-static void scheduleMe(int cid);
+static int getClass(int cid);
+static int scheduleMe(adp_waiter *w, int cid);
+static void unexpectMe(adp_waiter *w, size_t sent);
+static void yieldMe(adp_waiter *w);
+static void abandonMe(adp_waiter *w);
+static void adaptive_stats(FILE *out);
+static void adaptive_speed(int cid, int speed, int joined);
+static void adaptive_leave(int cid);
+static void stats_print(FILE *out);
 
 /**
  Misc. Helper Functions
@@ -26,8 +51,7 @@ static void verbose(const char *format, ...) {
   if (!verbose_f) return;
   va_list args;
   va_start(args, format);
-  vfprintf(stderr, format, args);
-  fprintf(stderr, "\n");
+  accesslog_verbose(format, args);
   va_end(args);
 }
 
@@ -82,7 +106,15 @@ int get_port_num(int sock_fd) {
   return ntohs(((struct sockaddr_in6 *)sa)->sin6_port);
 }
 
-int create_and_bind_sock(int port) {
+void pin_attr(pthread_attr_t *attr, int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if ((errno = pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &set)) != 0)
+    perror("pthread_attr_setaffinity_np");
+}
+
+int create_and_bind_sock(int port, int reuseport) {
   int yes=1, portlen, r, newfd;
   struct addrinfo hints, *servinfo, *p;
   char *portstr;
@@ -113,6 +145,12 @@ int create_and_bind_sock(int port) {
       perror("setsockopt");
       global_exit(1);
     }
+    
+    if (reuseport && setsockopt(newfd, SOL_SOCKET, SO_REUSEPORT, &yes,
+          sizeof(int)) == -1) {
+      perror("setsockopt");
+      global_exit(1);
+    }
 
     if (bind(newfd, p->ai_addr, p->ai_addrlen) == -1) {
       close(newfd);
@@ -128,672 +166,2278 @@ int create_and_bind_sock(int port) {
 }
 
 static size_t trim_in_place(char *string) {
-  int start, end;
-  size_t len;
-  char *buffer;
-  char *p = string;
+  size_t start, end;
   start = 0;
-  while (isspace(*p)) {
+  while (isspace(string[start]))
     ++start;
-    ++p;
+  end = start + strlen(string + start);
+  while (end > start && isspace(string[end - 1]))
+    --end;
+  memmove(string, string + start, end - start);
+  string[end - start] = '\0';
+  return end - start;
+}
+
+/* Terminates the first complete line in ci->buffer and returns its length
+   including the newline, or 0 if it has not fully arrived yet. */
+static size_t frame_line(clientinfo *ci) {
+  char *nl = (char *)memchr(ci->buffer, '\n', ci->used);
+  if (ci->overlong) {
+    if (!nl) {
+      ci->used = 0;
+      return 0;
+    }
+    ci->overlong = 0;
+    ci->used -= nl - ci->buffer + 1;
+    memmove(ci->buffer, nl + 1, ci->used);
+    nl = (char *)memchr(ci->buffer, '\n', ci->used);
   }
-  if (*p == '\0') { // All spaces?
-    *string = '\0'; // Empty string that shit
+  if (!nl)
     return 0;
+  *nl = '\0';
+  return nl - ci->buffer + 1;
+}
+
+/* Drops a framed line, keeping whatever was pipelined after it */
+static void consume_line(clientinfo *ci, size_t len) {
+  ci->used -= len;
+  memmove(ci->buffer, ci->buffer + len, ci->used);
+}
+
+/* Starts timing the request line in name for its access log record */
+static void access_begin(clientinfo *ci, const char *name) {
+  size_t n = strnlen(name, sizeof ci->request - 1);
+  memcpy(ci->request, name, n);
+  ci->request[n] = '\0';
+  ci->started = metrics_now_ns();
+  ci->sent = 0;
+  ci->img = NULL;
+  ci->traced = trace_f && ci->parent && trace_sample();
+  if (ci->traced)
+    ci->cpu_started = trace_cpu_ns();
+}
+
+/* Records a span from start until now if the current request is traced.
+   Returns it for the optional fields, or NULL. */
+static trace_event *trace_request(clientinfo *ci, const char *name, uint64_t start) {
+  if (!ci->traced)
+    return NULL;
+  return trace_span(name, ci->parent->pool->id, ci->parent->id, ci->cid,
+    start, metrics_now_ns());
+}
+
+/* Logs the request access_begin() started, answered by the response line
+   in out once its body is out */
+static void access_end(clientinfo *ci, const char *out) {
+  char status[12];
+  trace_event *e;
+  size_t n;
+  if (ci->started == 0)
+    return; /* HELLO */
+  if ((e = trace_request(ci, "request", ci->started)) != NULL) {
+    e->file = ci->img ? ci->img->name : NULL;
+    e->bytes = ci->sent;
+    e->cpu_us = (trace_cpu_ns() - ci->cpu_started) / 1000;
   }
-  end = strlen(string) - 1;
-  p = string + end;
-  while (p > string && isspace(*p)) {
-    --end;
-    --p;
+  ci->traced = 0;
+  n = strcspn(out, ":\n");
+  if (n >= sizeof status)
+    n = sizeof status - 1;
+  memcpy(status, out, n);
+  status[n] = '\0';
+  accesslog_add(ci->addr, ci->cid, status, ci->request, ci->sent,
+    (metrics_now_ns() - ci->started) / 1000);
+  ci->started = 0;
+}
+
+/* Logs the end of a connection the client closed */
+static void access_disconnect(clientinfo *ci) {
+  accesslog_add(ci->addr, ci->cid, "DISCONNECT", NULL, 0,
+    (metrics_now_ns() - ci->opened) / 1000);
+}
+
+static void count_sent(clientinfo *ci, size_t n) {
+  metrics_add(M_BYTES_SENT, n);
+  ci->sent += n;
+}
+
+/* Formats a FILE or ERROR response line into out. Requests that are part
+   of a BATCH name the file they answer in a trailing field. */
+static void reply_line(clientinfo *ci, char *out, const char *kind, const char *value, const char *name) {
+  int r;
+  if (ci->batched)
+    r = snprintf(out, BUFFER_SIZE, "%s:%s:%s\n", kind, value, name);
+  else
+    r = snprintf(out, BUFFER_SIZE, "%s:%s\n", kind, value);
+  if (r >= BUFFER_SIZE)
+    out[BUFFER_SIZE-2] = '\n'; /* Truncated, but still one line */
+}
+
+/* Client has more responses coming, so this one may be coalesced */
+static int more_replies(clientinfo *ci) {
+  return ci->batch > 0;
+}
+
+/* Answers a request line too long for the buffer with ERROR, dropping the
+   rest of it as it arrives. Inside a BATCH it still takes up an item,
+   named "-" as the name never fit. */
+static void overlong_request(clientinfo *ci, const char *who, char *out) {
+  ci->batched = ci->batch > 0;
+  if (ci->batched)
+    --ci->batch;
+  metrics_add(M_REQUESTS, 1);
+  access_begin(ci, "");
+  reply_line(ci, out, "ERROR", "Internal Server Error", "-");
+  verbose("%s: Illegal or corrupted client command", who);
+  metrics_add(M_ERR_BAD_REQUEST, 1);
+  ci->used = 0;
+  ci->overlong = 1;
+}
+
+/* Answers a ranged request with PART:<offset>:<length>:<size> and primes
+   ci->remain/offset to send just that slice of the file. */
+static int range_header(clientinfo *ci, const char *who, char *out) {
+  char part[72 + VALIDATOR_LEN];
+  if (ci->range_off > ci->st.st_size) {
+    reply_line(ci, out, "ERROR", "Invalid range", ci->img->name);
+    verbose("%s: Range starts past end of file.", who);
+    metrics_add(M_ERR_BAD_REQUEST, 1);
+    return -1;
   }
-  ++end; /* we went too far */
-  len = end-start;
-  buffer = (char *)emalloc(len+1); /* room for null char */
-  memcpy(buffer, (string + start), len);
-  buffer[len] = '\0';
-  memcpy(string, buffer, len+1);
-  efree(buffer);
-  return len;
+  ci->offset = ci->range_off;
+  ci->remain = ci->st.st_size - ci->range_off;
+  if (ci->range_len > 0 && ci->range_len < ci->remain)
+    ci->remain = ci->range_len;
+  snprintf(part, sizeof part, "%ld:%ld:%ld:%s",
+    (long)ci->offset, (long)ci->remain, (long)ci->st.st_size, ci->validator);
+  reply_line(ci, out, "PART", part, ci->img->name);
+  return 0;
 }
 
-static int contains_parent_path(char *path){
-  int len = strlen(path);
-  if (len == 2 && strcmp(path, "..") == 0)
-    return 1;
-  if (len > 2) {
-    if (strncmp(path, "../", 3) == 0)
-      return 1;
-    if (strcmp((path+strlen(path)-3), "/..") == 0)
-      return 1;
-    if (strstr(path, "/../") != NULL)
-      return 1;
+/* Writes the response line for the file described by ci->st into out and
+   primes ci->remain/offset. Returns -1 with a reply that has no body
+   instead, either the ERROR line or SAME if the client's copy is current. */
+static int request_header(clientinfo *ci, const char *who, char *out) {
+  char size[24 + VALIDATOR_LEN];
+  if (S_ISDIR (ci->st.st_mode)) {
+    reply_line(ci, out, "ERROR", "File is a directory", ci->img->name);
+    verbose("%s: File is a directory.", who);
+    metrics_add(M_ERR_IS_DIR, 1);
+    return -1;
+  }
+  /* Only conditional requests get a validator. It is the size and mtime
+     fstat saw, so a file that changed since startup no longer matches,
+     and no file is read to hash it. */
+  if (ci->conditional)
+    snprintf(ci->validator, VALIDATOR_LEN, "%llx-%llx", (unsigned long long)ci->st.st_size,
+      (unsigned long long)ci->st.st_mtim.tv_sec * 1000000000ULL + ci->st.st_mtim.tv_nsec);
+  else
+    strcpy(ci->validator, "-");
+  if (ci->conditional && strcmp(ci->ifval, "-") == 0) {
+    /* IF:-: asks for the validator of a file the client holds no copy of */
+  } else if (ci->conditional && strcmp(ci->ifval, ci->validator) == 0) {
+    if (!ci->ranged) {
+      reply_line(ci, out, "SAME", ci->validator, ci->img->name);
+      verbose("%s: Client copy is current.", who);
+      return -1;
+    }
+  } else if (ci->conditional) {
+    /* The client's partial copy is stale, so the range is meaningless */
+    ci->ranged = 0;
+  }
+  if (ci->ranged)
+    return range_header(ci, who, out);
+  snprintf(size, sizeof size, "%ld:%s", (long)ci->st.st_size, ci->validator);
+  reply_line(ci, out, "FILE", size, ci->img->name);
+  ci->remain = ci->st.st_size;
+  ci->offset = 0;
+  return 0;
+}
+
+/* Parses RANGE:<offset>:<length>:<name>, a length of 0 meaning up to the
+   end of the file. Returns the name, or NULL with the ERROR line in out. */
+static char *range_request(clientinfo *ci, char *line, const char *who, char *out) {
+  char *p, *end;
+  long long off, len;
+  errno = 0;
+  off = strtoll(line + 6, &end, 10);
+  if (errno || *end != ':' || off < 0)
+    goto invalid;
+  p = end + 1;
+  len = strtoll(p, &end, 10);
+  if (errno || *end != ':' || len < 0 || end == p)
+    goto invalid;
+  ci->ranged = 1;
+  ci->range_off = (off_t)off;
+  ci->range_len = (size_t)len;
+  return end + 1;
+invalid:
+  reply_line(ci, out, "ERROR", "Invalid range", line);
+  verbose("%s: Invalid range \"%s\".", who, line);
+  metrics_add(M_ERR_BAD_REQUEST, 1);
+  return NULL;
+}
+
+/* Parses IF:<validator>:<request>. On its own this asks for SAME instead
+   of the file when the validator still matches; in front of a RANGE it
+   asks for the range only if it matches and the whole file otherwise.
+   A validator of - matches nothing, it only asks for one in the reply.
+   Validators are the file's size and mtime, nothing read from its
+   contents, so a rewrite that keeps the size within the filesystem's
+   mtime granularity (or one that restores the old mtime) still matches
+   and is answered SAME. Cached entries are re-stat'd on every hit, so
+   the cache adds no staleness of its own.
+   Returns the rest of the request, or NULL with the ERROR line in out. */
+static char *cond_request(clientinfo *ci, char *line, const char *who, char *out) {
+  char *end = strchr(line + 3, ':');
+  if (!end || end - (line + 3) >= VALIDATOR_LEN) {
+    reply_line(ci, out, "ERROR", "Invalid validator", line);
+    verbose("%s: Invalid conditional \"%s\".", who, line);
+    metrics_add(M_ERR_BAD_REQUEST, 1);
+    return NULL;
+  }
+  memcpy(ci->ifval, line + 3, end - (line + 3));
+  ci->ifval[end - (line + 3)] = '\0';
+  ci->conditional = 1;
+  return end + 1;
+}
+
+/* Handles SPEED:<n>, a pan speed update sent in-band by an adaptive client
+   that saw SPEED offered in HELLO. The first one registers the client, as
+   the handshake on the adaptive port does. Returns 1 as there is nothing
+   to reply, or -1 with the ERROR line in out. */
+static int speed_request(clientinfo *ci, char *line, const char *who, char *out) {
+  char *end;
+  long speed;
+  if (!adaptive_f) {
+    snprintf(out, BUFFER_SIZE, "ERROR:Not in adaptive mode\n");
+    return -1;
+  }
+  errno = 0;
+  speed = strtol(line + 6, &end, 10);
+  while (isspace(*end))
+    ++end;
+  if (errno || *end != '\0' || end == line + 6) {
+    snprintf(out, BUFFER_SIZE, "ERROR:Invalid speed\n");
+    verbose("%s: Invalid speed update \"%s\".", who, line);
+    metrics_add(M_ERR_BAD_REQUEST, 1);
+    return -1;
+  }
+  verbose("%s: Got update from client %d: %ld.", who, ci->cid, speed);
+  adaptive_speed(ci->cid, (int)speed, !ci->inband);
+  ci->inband = 1;
+  return 1;
+}
+
+/* Applies SPEED lines that arrived while a body is going out, leaving
+   anything else buffered until it is done */
+static void absorb_speeds(clientinfo *ci, const char *who) {
+  char *line, *nl, scratch[BUFFER_SIZE];
+  ssize_t r;
+  size_t len;
+  r = recv(ci->socketfd, ci->buffer + ci->used, BUFFER_SIZE - 1 - ci->used, MSG_DONTWAIT);
+  if (r > 0)
+    ci->used += r;
+  line = ci->buffer;
+  while ((nl = (char *)memchr(line, '\n', ci->buffer + ci->used - line)) != NULL) {
+    len = nl - line + 1;
+    if (strncmp(line, "SPEED:", 6) != 0) {
+      line = nl + 1;
+      continue;
+    }
+    *nl = '\0';
+    speed_request(ci, line, who, scratch);
+    ci->used -= len;
+    memmove(line, nl + 1, ci->buffer + ci->used - line);
+  }
+}
+
+/* Handles BATCH:<n>, after which the next n request lines are answered as
+   one stream of records that each name their file. Returns 1 when there is
+   nothing to send yet, or -1 with the ERROR line in out. */
+static int batch_request(clientinfo *ci, char *line, const char *who, char *out) {
+  char *end;
+  long n;
+  errno = 0;
+  n = strtol(line + 6, &end, 10);
+  if (errno || *end != '\0' || n < 1 || n > MAX_BATCH) {
+    snprintf(out, BUFFER_SIZE, "ERROR:Invalid batch size\n");
+    verbose("%s: Invalid batch \"%s\".", who, line);
+    metrics_add(M_ERR_BAD_REQUEST, 1);
+    return -1;
+  }
+  verbose("%s: Batch of %ld requests.", who, n);
+  ci->batch = (int)n;
+  return 1;
+}
+
+/* Answers STATS with STATS:<length> and the metrics as its body. They are
+   written to a memfd, so every engine sends them as it would a file. */
+static int stats_request(clientinfo *ci, const char *who, char *out) {
+  char size[24], *msg;
+  FILE *f = NULL;
+  int fd, copy;
+  fd = memfd_create("stats", MFD_CLOEXEC);
+  copy = fd == -1 ? -1 : dup(fd);
+  if (copy == -1 || !(f = fdopen(copy, "w"))) {
+    msg = strerror(errno);
+    reply_line(ci, out, "ERROR", msg, "STATS");
+    verbose("%s: stats: %s", who, msg);
+    if (copy != -1)
+      close(copy);
+    if (fd != -1)
+      close(fd);
+    return -1;
   }
+  stats_print(f);
+  fclose(f);
+  ci->img = NULL;
+  ci->filefd = fd;
+  ci->offset = 0;
+  ci->remain = lseek(fd, 0, SEEK_END);
+  snprintf(size, sizeof size, "%ld", (long)ci->remain);
+  reply_line(ci, out, "STATS", size, "STATS");
   return 0;
 }
 
+/* Looks the request line in name up in the image index, leaving the entry
+   in ci->img for file_header() once the file is open. Returns -1 with an
+   ERROR line in out, or 1 if the line needs no reply. STATS comes back
+   with ci->filefd already open and its reply in out. */
+static int lookup_request(clientinfo *ci, char *name, const char *who, char *out) {
+  uint64_t start;
+  trim_in_place(name);
+  verbose("%s: Got input \"%s\" from client.", who, name);
+  if (strncmp(name, "SPEED:", 6) == 0)
+    return speed_request(ci, name, who, out);
+  if (ci->batch == 0 && strncmp(name, "BATCH:", 6) == 0)
+    return batch_request(ci, name, who, out);
+  ci->batched = ci->batch > 0;
+  if (ci->batched)
+    --ci->batch;
+  metrics_add(M_REQUESTS, 1);
+  access_begin(ci, name);
+  if (strcmp(name, "STATS") == 0)
+    return stats_request(ci, who, out);
+  ci->conditional = 0;
+  if (strncmp(name, "IF:", 3) == 0 && !(name = cond_request(ci, name, who, out)))
+    return -1;
+  ci->ranged = 0;
+  if (strncmp(name, "RANGE:", 6) == 0 && !(name = range_request(ci, name, who, out)))
+    return -1;
+  if (strchr(name, ':')) {
+    /* Would make the name a batched reply carries ambiguous */
+    reply_line(ci, out, "ERROR", "Invalid name", "-");
+    verbose("%s: Invalid name \"%s\".", who, name);
+    metrics_add(M_ERR_BAD_REQUEST, 1);
+    return -1;
+  }
+  start = metrics_now_ns();
+  ci->img = imgindex_lookup(&images, name);
+  metrics_since(M_LOOKUP_US, start);
+  if (!ci->img) {
+    reply_line(ci, out, "ERROR", strerror(ENOENT), name);
+    verbose("%s: Not in image index.", who);
+    metrics_add(M_ERR_NOT_FOUND, 1);
+    return -1;
+  }
+  trace_request(ci, "lookup", start);
+  return 0;
+}
+
+/* Answers a request whose file is open in ci->filefd or cached in
+   ci->entry. The header describes what is about to be sent, not what the
+   index saw at startup, so a file replaced since cannot desync the
+   stream. st is the open file's fstat if the caller already has it, NULL
+   to take it here. Returns -1, with the file closed, when the reply has
+   no body. */
+static int file_header(clientinfo *ci, const char *who, char *out, const struct stat *st) {
+  char *msg;
+  uint64_t start;
+  int r = 0;
+  if (ci->entry) {
+    ci->st.st_mode = S_IFREG;
+    ci->st.st_size = ci->entry->size;
+    ci->st.st_mtim = ci->entry->mtime;
+  } else if (st) {
+    ci->st = *st;
+  } else {
+    start = metrics_now_ns();
+    r = fstat(ci->filefd, &ci->st);
+    metrics_since(M_FSTAT_US, start);
+    trace_request(ci, "fstat", start);
+  }
+  if (r == -1) {
+    msg = strerror(errno);
+    reply_line(ci, out, "ERROR", msg, ci->img->name);
+    verbose("%s: fstat: %s", who, msg);
+    metrics_add(M_ERR_OPEN, 1);
+    ci->st.st_mode = 0;
+  }
+  if (ci->st.st_mode != 0 && request_header(ci, who, out) == 0)
+    return 0;
+  if (ci->entry) {
+    cache_release(&cache, ci->entry);
+    ci->entry = NULL;
+  } else {
+    close(ci->filefd);
+    ci->filefd = -1;
+  }
+  return -1;
+}
+
+/* Serves the request from the image cache if possible. Returns 0 with
+   the header in out and ci->entry referenced, or ci->filefd open if the
+   cache opened a file too large to keep. Returns -1 with a reply that has
+   no body, or 1 if the file has to be opened here. With CACHE_NOSTAT in
+   flags a hit returns 2 and no header until cache_check() passes it. */
+static int cache_request(clientinfo *ci, int flags, const char *who, char *out) {
+  struct stat st;
+  int err, fd;
+  ci->entry = cache_get(&cache, ci->img->name, flags, &fd, &st, &err);
+  if (ci->entry) {
+    verbose("%s: Cache hit.", who);
+    return (flags & CACHE_NOSTAT) ? 2 : file_header(ci, who, out, NULL);
+  }
+  if (err) {
+    reply_line(ci, out, "ERROR", strerror(err), ci->img->name);
+    verbose("%s: cache: %s", who, strerror(err));
+    return -1;
+  }
+  if (fd == -1)
+    return 1;
+  verbose("%s: Too large to cache, sending from disk.", who);
+  ci->filefd = fd;
+  return file_header(ci, who, out, &st);
+}
+
+/* Resolves the request line in name against the image index. On success
+   the file is left open in ci->filefd (or cached in ci->entry), out holds
+   the FILE line and 0 is returned. Otherwise out holds a reply without a
+   body and -1 is returned, or 1 if the line needs no reply. */
+static int open_request(clientinfo *ci, char *name, const char *who, char *out) {
+  char *msg;
+  int r, flags;
+  uint64_t start;
+  if ((r = lookup_request(ci, name, who, out)) != 0 || ci->filefd != -1)
+    return r;
+  /* Event loops must not read a whole file or wait on another load */
+  flags = ci->parent ? 0 : CACHE_NOWAIT;
+  if (cache_f && (r = cache_request(ci, flags, who, out)) != 1)
+    return r;
+  verbose("%s: Attempting to open file \"%s\"", who, ci->img->name);
+  start = metrics_now_ns();
+  ci->filefd = openat(images.dirfd, ci->img->name, O_RDONLY);
+  metrics_since(M_OPEN_US, start);
+  trace_request(ci, "open", start);
+  if (ci->filefd == -1) {
+    msg = strerror(errno);
+    reply_line(ci, out, "ERROR", msg, ci->img->name);
+    verbose("%s: openat: %s", who, msg);
+    metrics_add(M_ERR_OPEN, 1);
+    return -1;
+  }
+  verbose("%s: Found file.", who);
+  return file_header(ci, who, out, NULL);
+}
+
+/* Applies the rate for a request in the given adaptive class (-1 when
+   unclassified) to ci, in the kernel if it can pace the socket and with
+   ci->pace otherwise. */
+static void pace_request(clientinfo *ci, int class) {
+  uint64_t rate = pace_rate;
+  if (class >= 0 && class_rate[class] > 0)
+    rate = class_rate[class];
+  if (!__atomic_load_n(&pace_sw, __ATOMIC_RELAXED)) {
+    if (rate == ci->kernel_rate)
+      return;
+    if (pacing_set(ci->socketfd, rate) == 0) {
+      ci->kernel_rate = rate;
+      return;
+    }
+    /* Workers race to get here, the first one out says so */
+    if (!__atomic_exchange_n(&pace_sw, 1, __ATOMIC_RELAXED))
+      verbose("Pacing: SO_MAX_PACING_RATE: %s, falling back to software.", strerror(errno));
+  }
+  if (rate != ci->pace_rate) {
+    ci->pace_rate = rate;
+    if (rate > 0)
+      tbucket_init(&ci->pace, rate, pace_burst);
+  }
+}
+
+/* Bytes of the body ci may send now. Returns 0 with wait_ns set when a
+   paced connection has to wait for tokens. */
+static size_t pace_len(clientinfo *ci, long *wait_ns) {
+  if (ci->pace_rate == 0)
+    return ci->remain;
+  return tbucket_take(&ci->pace, ci->remain, wait_ns);
+}
+
+/* Returns tokens granted by pace_len() that were not sent */
+static void pace_unused(clientinfo *ci, size_t granted, ssize_t sent) {
+  if (ci->pace_rate > 0)
+    tbucket_refund(&ci->pace, granted - (sent > 0 ? sent : 0));
+}
+
 /**
  Executor Cached Thread Pool
 */
-threadpool_t pool;
+/* Starts a new worker in t, which must have no live thread. It serves
+   t->socketfd, or looks at the queue first when that is -1. */
+static int executor_spawn(threadpool_t *pool, threadpool_task_t *t) {
+  int r;
+  pthread_attr_t attr;
+  t->id = ++pool->count;
+  t->state = TASK_BUSY;
+  __atomic_add_fetch(&pool->workers, 1, __ATOMIC_RELAXED);
+  pthread_attr_init(&attr);
+  if (pool->cpu >= 0)
+    pin_attr(&attr, pool->cpu);
+  if (pool->stack_size > 0)
+    pthread_attr_setstacksize(&attr, pool->stack_size);
+  r = pthread_create(&(t->tid), &attr, executor_thread, t);
+  pthread_attr_destroy(&attr);
+  if (r) {
+    __atomic_sub_fetch(&pool->workers, 1, __ATOMIC_RELAXED);
+    t->state = TASK_EMPTY;
+    errno = r;
+    perror("pthread_create");
+    return -1;
+  }
+  return t->id;
+}
 
-int executor_init() {
-  pool.count = 0;
-  pool.workers = 0;
-  pool.cached = NULL;
-  pool.shutdown = 0;
-  pool.running = 1;
-  return pthread_mutex_init(&(pool.lock), NULL);
+/* Wakes the keeper before its next tick */
+static void executor_chore(threadpool_t *pool) {
+  __atomic_add_fetch(&pool->chores, 1, __ATOMIC_RELEASE);
+  futex_wake(&pool->chores, 1);
 }
 
-int executor_execute(int socketfd, int cid, char *addr) {
-  int r;
-  pthread_mutex_lock(&(pool.lock));
-  if (!pool.running) {
-    pthread_mutex_unlock(&(pool.lock));
-    errno = EINTR;
+/* Starts an idle worker in a free slot. Returns -1 when there is no slot
+   or the thread could not start. */
+static int executor_grow(threadpool_t *pool) {
+  threadpool_task_t *t;
+  int64_t i;
+  if ((i = lfstack_pop(&pool->free)) == -1)
+    return -1;
+  t = pool->tasks[i];
+  if (t->state == TASK_GONE)
+    executor_reap(t);
+  t->socketfd = -1;
+  if (executor_spawn(pool, t) == -1) {
+    lfstack_push(&pool->free, t->slot);
     return -1;
   }
+  return 0;
+}
+
+/* Retires an idle worker. Returns -1 when none is idle. */
+static int executor_shrink(threadpool_t *pool) {
   threadpool_task_t *t;
-  if (pool.cached == NULL) { /* No cached threads */
-    if (pool.workers >= MAX_WORKERS) {
-      pthread_mutex_unlock(&(pool.lock));
-      errno = EBUSY;
-      return -1;
+  int64_t i;
+  int idle;
+  while ((i = lfstack_pop(&pool->idle)) != -1) {
+    t = pool->tasks[i];
+    idle = TASK_IDLE;
+    if (__atomic_compare_exchange_n(&t->state, &idle, TASK_GONE, 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      futex_wake(&t->state, 1);
+      executor_reap(t);
+      lfstack_push(&pool->free, t->slot);
+      return 0;
     }
-    t = ALLOC(threadpool_task_t);
-    t->id = ++pool.count;
-    t->cid = cid;
-    strncpy(t->addr, addr, INET6_ADDRSTRLEN);
-    t->socketfd = socketfd;
-    t->cached = 0;
-    t->stopped = 0;
-    pthread_mutex_init(&(t->lock), NULL);
-    pthread_cond_init(&(t->notify), NULL);
-    t->prev = NULL;
-    t->next = NULL;
-    r = pthread_create(&(t->tid), NULL, executor_thread, t);
-    if (r) {
-      errno = r;
-      perror("pthread_create");
-    } else {
-      ++pool.workers;
+    lfstack_push(&pool->free, t->slot);
+  }
+  return -1;
+}
+
+/* Resizes the pool once a tick. It grows by the backlog of queued
+   connections, or by half again when they waited longer than
+   EXEC_TARGET_DELAY_US. Every EXEC_SHRINK_TICKS while fewer than
+   EXEC_SHRINK_UTIL of the workers are busy it retires an
+   EXEC_SHRINK_DIV'th of those above min_workers, at least one. */
+static void executor_scale(threadpool_t *pool) {
+  unsigned long n, sum;
+  int workers, idlers, backlog, want, i;
+  n = __atomic_exchange_n(&pool->delay_count, 0, __ATOMIC_RELAXED);
+  sum = __atomic_exchange_n(&pool->delay_sum_us, 0, __ATOMIC_RELAXED);
+  workers = __atomic_load_n(&pool->workers, __ATOMIC_RELAXED);
+  idlers = __atomic_load_n(&pool->idlers, __ATOMIC_RELAXED);
+  backlog = (int)mpmcq_length(&pool->queue);
+  pool->delay_us = n > 0 ? (long)(sum / n) : 0;
+  pool->util = EXEC_UTIL_ALPHA * (workers > 0 ? (double)(workers - idlers) / workers : 0)
+    + (1 - EXEC_UTIL_ALPHA) * pool->util;
+  want = pool->min_workers - workers;
+  i = backlog;
+  if (pool->delay_us > EXEC_TARGET_DELAY_US && i < workers / 2 + 1)
+    i = workers / 2 + 1;
+  if (want < i)
+    want = i;
+  if (want > 0) {
+    pool->calm = 0;
+    if (pool->hold > 0) {
+      --pool->hold;
+      return;
     }
-  } else { /* Use a cached thread */
-    t = pool.cached;
-    pthread_mutex_lock(&(t->lock));
-    if (t->cached != 1){
-      fprintf(stderr, "Executor: Fatal Error: Cached thread-%d is not cached\n", t->id);
-      global_exit(1);
+    for (i = 0; i < want && executor_grow(pool) == 0; ++i)
+      ;
+    if (i < want && workers + i < pool->max_workers)
+      pool->hold = EXEC_RESPAWN_TICKS;
+    if (i > 0) {
+      pool->grown += i;
+      ++pool->grow_events;
+      if (workers + i > pool->peak)
+        pool->peak = workers + i;
+      verbose("Executor-%d: Grew by %d to %d workers, %d queued, %ld us queueing delay.",
+        pool->id, i, workers + i, backlog, pool->delay_us);
     }
-    if (t->stopped){
-      fprintf(stderr, "Executor: Fatal Error: Cached thread-%d has terminated\n", t->id);
-      global_exit(1);
+    return;
+  }
+  if (pool->util < EXEC_SHRINK_UTIL && idlers > 0 && workers > pool->min_workers) {
+    if (++pool->calm < EXEC_SHRINK_TICKS)
+      return;
+    pool->calm = 0;
+    want = (workers - pool->min_workers) / EXEC_SHRINK_DIV;
+    if (want > idlers)
+      want = idlers;
+    for (i = 0; i < (want > 0 ? want : 1) && executor_shrink(pool) == 0; ++i)
+      ;
+    if (i > 0) {
+      pool->shrunk += i;
+      verbose("Executor-%d: Retired %d workers, %d left, %.0f%% busy.",
+        pool->id, i, workers - i, pool->util * 100);
     }
-    
-    /* Pop off cached pool */
-    pool.cached = t->next;
-    if (pool.cached)
-      pool.cached->prev = NULL;
-    t->next = NULL;
-    
-    /* Init */
-    t->cid = cid;
-    strncpy(t->addr, addr, INET6_ADDRSTRLEN);
+  } else {
+    pool->calm = 0;
+  }
+}
+
+/* Sizes the pool, joins workers that exited and reports and closes
+   connections the acceptor turned away, so that the accept path never
+   joins, spawns or writes to stderr. */
+static void *executor_keeper(void *arg) {
+  threadpool_t *pool = (threadpool_t *)arg;
+  queued_conn c;
+  struct timespec tick;
+  int i, seen;
+  while (!pool->shutdown) {
+    seen = __atomic_load_n(&pool->chores, __ATOMIC_ACQUIRE);
+    while (mpmcq_pop(&pool->turned_away, &c) == 0) {
+      verbose("Client %s connection dropped: Accept queue full.", c.addr);
+      accesslog_add(c.addr, 0, "REJECT", NULL, 0, 0);
+      close(c.socketfd);
+      metrics_add(M_ERR_REJECTED, 1);
+    }
+    /* Exited workers keep their stacks until joined */
+    for (i = 0; i < pool->max_workers; ++i)
+      if (__atomic_load_n(&pool->tasks[i]->state, __ATOMIC_ACQUIRE) == TASK_GONE)
+        executor_reap(pool->tasks[i]);
+    executor_scale(pool);
+    if (pool->shutdown)
+      break;
+    clock_gettime(CLOCK_MONOTONIC, &tick);
+    timespec_add_ns(&tick, EXEC_TICK_MS * 1000000L);
+    futex_wait(&pool->chores, seen, &tick);
+  }
+  return NULL;
+}
+
+int executor_init(threadpool_t *pool, int id, int cpu, int min_workers,
+    int max_workers, int queue_depth, size_t stack_size, int queue_wait_ms) {
+  int i;
+  threadpool_task_t *t;
+  pool->id = id;
+  pool->cpu = cpu;
+  pool->min_workers = min_workers;
+  pool->max_workers = max_workers;
+  pool->count = 0;
+  pool->workers = 0;
+  pool->idlers = 0;
+  pool->tasks = (threadpool_task_t **)emalloc(max_workers * sizeof(threadpool_task_t *));
+  lfstack_init(&pool->idle, max_workers);
+  lfstack_init(&pool->free, max_workers);
+  mpmcq_init(&pool->queue, queue_depth, sizeof(queued_conn));
+  mpmcq_init(&pool->turned_away, queue_depth, sizeof(queued_conn));
+  pool->chores = 0;
+  pool->stack_size = stack_size;
+  pool->queue_wait_ns = queue_wait_ms * 1000000L;
+  pool->queued = 0;
+  pool->dropped = 0;
+  pool->rejected = 0;
+  pool->max_queued_us = 0;
+  pool->delay_sum_us = 0;
+  pool->delay_count = 0;
+  pool->delay_us = 0;
+  pool->util = 0;
+  pool->calm = 0;
+  pool->hold = 0;
+  pool->peak = min_workers;
+  pool->grown = 0;
+  pool->shrunk = 0;
+  pool->grow_events = 0;
+  pool->shutdown = 0;
+  pool->running = 1;
+  pthread_cond_init(&(pool->notify), NULL);
+  pthread_mutex_init(&(pool->lock), NULL);
+  LOCK_NAME(&(pool->lock), "pool.lock");
+  for (i = max_workers - 1; i >= 0; --i) {
+    t = ALLOC(threadpool_task_t);
+    t->pool = pool;
+    t->slot = i;
+    t->state = TASK_EMPTY;
+    pool->tasks[i] = t;
+    lfstack_push(&pool->free, i);
+  }
+  /* The warm minimum starts up front and goes idle without a socket */
+  for (i = 0; i < min_workers; ++i)
+    if (executor_grow(pool) == -1)
+      return -1;
+  if ((errno = pthread_create(&pool->keeper, NULL, executor_keeper, pool)) != 0) {
+    perror("pthread_create");
+    return -1;
+  }
+  return 0;
+}
+
+/* Hands socketfd to an idle worker, or -1 to have it look at the queue.
+   Idle workers are popped off a lock-free stack and claimed with a
+   compare and swap on their state, so this never waits on one. Returns
+   the worker's id, -1 when none is idle. */
+static int executor_dispatch(threadpool_t *pool, int socketfd, int cid, char *addr) {
+  threadpool_task_t *t;
+  int64_t i;
+  int idle;
+  while ((i = lfstack_pop(&pool->idle)) != -1) {
+    t = pool->tasks[i];
     t->socketfd = socketfd;
-    t->cached = 0;
-    
-    pthread_cond_signal(&(t->notify));
-    pthread_mutex_unlock(&(t->lock));
+    if (socketfd != -1) {
+      t->cid = cid;
+      strncpy(t->addr, addr, INET6_ADDRSTRLEN);
+    }
+    idle = TASK_IDLE;
+    if (__atomic_compare_exchange_n(&t->state, &idle, TASK_BUSY, 0,
+        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+      futex_wake(&t->state, 1);
+      return t->id;
+    }
+    /* Retired by shutdown while on the stack */
+    lfstack_push(&pool->free, t->slot);
+  }
+  return -1;
+}
+
+/* Gives socketfd to an idle worker, or queues it for the next worker to
+   finish. Only the shard's acceptor calls this. Returns -1 with EBUSY
+   when the queue is full. */
+int executor_execute(threadpool_t *pool, int socketfd, int cid, char *addr) {
+  queued_conn c;
+  int r;
+  if (!pool->running) {
+    errno = EINTR;
+    return -1;
+  }
+  if ((r = executor_dispatch(pool, socketfd, cid, addr)) != -1)
+    return r;
+  /* Every worker is busy, wait in line for one */
+  c.socketfd = socketfd;
+  c.cid = cid;
+  strncpy(c.addr, addr, INET6_ADDRSTRLEN);
+  clock_gettime(CLOCK_MONOTONIC, &c.since);
+  if (mpmcq_push(&pool->queue, &c) == -1) {
+    ++pool->rejected;
+    errno = EBUSY;
+    return -1;
   }
-  r = t->id;
-  executor_garbage_collect();
-  pthread_mutex_unlock(&(pool.lock));
-  return r;
+  ++pool->queued;
+  /* Pairs with executor_thread_idle(), one of the two sees the other */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (executor_dispatch(pool, -1, 0, NULL) == -1 && mpmcq_length(&pool->queue) == 1)
+    executor_chore(pool); /* A burst is starting, grow now */
+  return 0;
 }
 
-void executor_shutdown() {
-  pthread_mutex_lock(&(pool.lock));
+/* Leaves a connection executor_execute() refused for the reaper to
+   report and close. Returns -1 when the caller has to. */
+int executor_turn_away(threadpool_t *pool, int socketfd, char *addr) {
+  queued_conn c;
+  if (!pool->running)
+    return -1;
+  c.socketfd = socketfd;
+  strncpy(c.addr, addr, INET6_ADDRSTRLEN);
+  if (mpmcq_push(&pool->turned_away, &c) == -1)
+    return -1;
+  executor_chore(pool);
+  return 0;
+}
+
+void executor_shutdown(threadpool_t *pool) {
+  int i, idle;
+  threadpool_task_t *t;
+  queued_conn c;
   /* Signal all threads to shutdown */
-  pool.shutdown = 1;
-  pool.running = 0;
-  
-  threadpool_task_t *t, *s;
-  t = pool.cached;
-  while (t) {
-    pthread_mutex_lock(&(t->lock));
-    pthread_cond_signal(&(t->notify));
-    pthread_mutex_unlock(&(t->lock));
-    s = t;
-    t = t->next;
-  }
-  pool.cached = NULL;
-  while (pool.workers > 0) {
-    pthread_cond_wait(&(pool.notify), &(pool.lock));
-  }
-  executor_garbage_collect();
-  pthread_mutex_unlock(&(pool.lock));
-}
-
-void executor_thread_shutdown(threadpool_task_t *t) {
-  pthread_mutex_lock(&(pool.lock));
-  t->next = pool.stopped;
-  if (pool.stopped)
-    pool.stopped->prev = t;
-  pool.stopped = t;
-  --pool.workers;
-  pthread_cond_signal(&(pool.notify));
-  pthread_mutex_unlock(&(pool.lock));
+  pool->running = 0;
+  __atomic_store_n(&pool->shutdown, 1, __ATOMIC_SEQ_CST);
+  for (i = 0; i < pool->max_workers; ++i) {
+    t = pool->tasks[i];
+    idle = TASK_IDLE;
+    if (__atomic_compare_exchange_n(&t->state, &idle, TASK_GONE, 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      futex_wake(&t->state, 1);
+  }
+  executor_chore(pool);
+  pthread_join(pool->keeper, NULL);
+  pthread_mutex_lock(&(pool->lock));
+  while (pool->workers > 0) {
+    pthread_cond_wait(&(pool->notify), &(pool->lock));
+  }
+  pthread_mutex_unlock(&(pool->lock));
+  while (mpmcq_pop(&pool->queue, &c) == 0)
+    close(c.socketfd);
+  while (mpmcq_pop(&pool->turned_away, &c) == 0)
+    close(c.socketfd);
+  for (i = 0; i < pool->max_workers; ++i)
+    if (pool->tasks[i]->state == TASK_GONE)
+      executor_reap(pool->tasks[i]);
+}
+
+/* Counts the calling worker out of the pool, it must not touch its task
+   after this */
+static void executor_thread_leave(threadpool_t *pool) {
+  pthread_mutex_lock(&(pool->lock));
+  __atomic_sub_fetch(&pool->workers, 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&(pool->notify));
+  pthread_mutex_unlock(&(pool->lock));
+}
+
+/* A busy worker exiting leaves its slot free, for the keeper to join it
+   and refill if the pool needs it */
+void executor_thread_exit(threadpool_task_t *t) {
+  threadpool_t *pool = t->pool;
+  __atomic_store_n(&t->state, TASK_GONE, __ATOMIC_RELEASE);
+  lfstack_push(&pool->free, t->slot);
+  executor_chore(pool);
+  executor_thread_leave(pool);
 }
 
 void executor_thread_done(threadpool_task_t *t) {
-  pthread_mutex_lock(&(pool.lock));
-  t->next = pool.cached;
-  if (pool.cached)
-    pool.cached->prev = t;
-  pool.cached = t;
   t->socketfd = -1;
-  t->cached = 1;
-  pthread_mutex_unlock(&(pool.lock));
+  __atomic_store_n(&t->state, TASK_IDLE, __ATOMIC_RELEASE);
+  lfstack_push(&t->pool->idle, t->slot);
 }
 
-int executor_thread_expire(threadpool_task_t *t) {
-  if(pthread_mutex_trylock(&(pool.lock))) {
-    /* Did not get lock, main thread possibly in a executor_execute or shutdown */
-    fprintf(stderr, "executor_thread_expire: Warning: Could not acquire lock.\n");
-    return 1;
+/* Takes the oldest queued connection that has not waited too long into
+   t. Returns -1 when there is none. */
+static int executor_next(threadpool_task_t *t) {
+  threadpool_t *pool = t->pool;
+  queued_conn c;
+  struct timespec now;
+  long waited, max;
+  while (mpmcq_pop(&pool->queue, &c) == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    waited = (now.tv_sec - c.since.tv_sec) * 1000000000L + (now.tv_nsec - c.since.tv_nsec);
+    if (waited > pool->queue_wait_ns) {
+      verbose("Client %s connection dropped: Queued for %ld ms.", c.addr, waited / 1000000);
+      accesslog_add(c.addr, c.cid, "REJECT", NULL, 0, waited / 1000);
+      close(c.socketfd);
+      __atomic_add_fetch(&pool->dropped, 1, __ATOMIC_RELAXED);
+      metrics_add(M_ERR_REJECTED, 1);
+      continue;
+    }
+    metrics_observe(M_EXEC_WAIT_US, waited / 1000);
+    if (trace_f && trace_sample())
+      trace_span("queued", pool->id, t->id, c.cid,
+        (uint64_t)c.since.tv_sec * 1000000000ULL + c.since.tv_nsec,
+        (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec);
+    __atomic_add_fetch(&pool->delay_sum_us, waited / 1000, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool->delay_count, 1, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&pool->max_queued_us, __ATOMIC_RELAXED);
+    while (waited / 1000 > max && !__atomic_compare_exchange_n(&pool->max_queued_us,
+        &max, waited / 1000, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+    t->socketfd = c.socketfd;
+    t->cid = c.cid;
+    memcpy(t->addr, c.addr, INET6_ADDRSTRLEN);
+    return 0;
   }
-  t->stopped = 1;
-  
-  if (t->prev)
-    t->prev->next = t->next;
-  if (t->next)
-    t->next->prev = t->prev;
-  if (t == pool.cached)
-    pool.cached = t->next;
-  
-  t->next = pool.stopped;
-  if (pool.stopped)
-    pool.stopped->prev = t;
-  pool.stopped = t;
-  --pool.workers;
-  pthread_mutex_unlock(&(pool.lock));
-  return 0;
+  return -1;
 }
 
-void executor_garbage_collect() {
-  int cleaned = 0;
-  /* Expects caller to hold a lock to pool.lock */
-  if (pool.stopped) {
-    threadpool_task_t *t, *s;
-    t = pool.stopped;
-    while (t) {
-      pthread_join(t->tid, NULL);
-      s = t;
-      t = t->next;
-      efree(s);
-      cleaned++;
-    }
-    pool.stopped = NULL;
-    verbose("Executor: Garbage collect freed %d threads.", cleaned);
-  }
+/* Waits on the idle stack until handed a socket, or -1 to look at the
+   queue again. Returns -1 when shutdown retired the worker instead. */
+static int executor_thread_idle(threadpool_task_t *t) {
+  threadpool_t *pool = t->pool;
+  int r;
+  __atomic_add_fetch(&pool->idlers, 1, __ATOMIC_RELAXED);
+  executor_thread_done(t);
+  verbose("Thread-%d: Waiting for next job.", t->id);
+  /* A connection queued since executor_next() looked would otherwise
+     wait for the next worker to finish */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (mpmcq_length(&pool->queue) > 0)
+    executor_dispatch(pool, -1, 0, NULL);
+  while ((r = __atomic_load_n(&t->state, __ATOMIC_ACQUIRE)) == TASK_IDLE)
+    futex_wait(&t->state, TASK_IDLE, NULL);
+  __atomic_sub_fetch(&pool->idlers, 1, __ATOMIC_RELAXED);
+  return r == TASK_GONE ? -1 : 0;
+}
+
+void executor_reap(threadpool_task_t *t) {
+  pthread_join(t->tid, NULL);
+  t->state = TASK_EMPTY;
+  verbose("Executor: Reaped thread-%d.", t->id);
+}
+
+void executor_stats(threadpool_t *pool, FILE *out) {
+  fprintf(out, "Executor-%d: %d workers, %lu connections queued (longest %ld us), "
+    "%lu dropped after %ld ms, %lu rejected with a full queue.\n", pool->id,
+    __atomic_load_n(&pool->workers, __ATOMIC_RELAXED), pool->queued,
+    __atomic_load_n(&pool->max_queued_us, __ATOMIC_RELAXED),
+    __atomic_load_n(&pool->dropped, __ATOMIC_RELAXED),
+    pool->queue_wait_ns / 1000000, pool->rejected);
+  fprintf(out, "Executor-%d: %d idle of %d-%d workers (peak %d), %.0f%% busy, "
+    "%ld us queueing delay; grew %lu times by %lu workers, retired %lu.\n",
+    pool->id, __atomic_load_n(&pool->idlers, __ATOMIC_RELAXED), pool->min_workers,
+    pool->max_workers, pool->peak, pool->util * 100, pool->delay_us,
+    pool->grow_events, pool->grown, pool->shrunk);
 }
 
 static void handle_cleanup(void *arg) {
   clientinfo *ci = (clientinfo *)arg;
+  if (ci->entry)
+    cache_release(&cache, ci->entry);
   if (adaptive_f)
-      unexpectMe();
+    abandonMe(&ci->turn);
+  if (ci->inband)
+    adaptive_leave(ci->parent->cid);
   if (ci->parent->socketfd != -1)
     close(ci->parent->socketfd);
-  if (ci->filename)
-    efree(ci->filename);
-  efree(ci);
+  if (ci->filefd != -1)
+    close(ci->filefd);
+  if (adaptive_f)
+    pthread_cond_destroy(&ci->turn.turn);
+  mempool_put(&clientinfo_pool, ci);
 }
 
 void *executor_thread(void *task) {
   threadpool_task_t *t = (threadpool_task_t *)task;
+  threadpool_t *pool = t->pool;
   int r; /* Return values from system calls */
-  char *msg;
+  int class, turn_class; /* Adaptive priority of the current request */
+  int err;
+  size_t len;
+  uint64_t start;
+  trace_event *e;
   char send_buf[BUFFER_SIZE];
+  char who[16];
   clientinfo *ci = NULL;
+  snprintf(who, sizeof who, "Thread-%d", t->id);
   for (;;) {
-    if (pool.shutdown) {
+    if (pool->shutdown) {
       if (t->socketfd != -1)
         close(t->socketfd);
-      executor_thread_shutdown(t);
+      executor_thread_exit(t);
       pthread_exit(NULL);
       return NULL;
     }
-    ci = ALLOC(clientinfo);
+    if (t->socketfd == -1 && executor_next(t) == -1) {
+      if (executor_thread_idle(t) == -1) {
+        executor_thread_leave(pool);
+        pthread_exit(NULL);
+        return NULL;
+      }
+      continue;
+    }
+    ci = POOL_GET(&clientinfo_pool, clientinfo);
     /* Initialize client variables */
     ci->parent = t;
+    ci->socketfd = t->socketfd;
+    ci->cid = t->cid;
+    memcpy(ci->addr, t->addr, INET6_ADDRSTRLEN);
+    ci->opened = metrics_now_ns();
+    ci->started = 0;
+    ci->traced = 0;
+    ci->used = 0;
+    ci->batch = 0;
+    ci->overlong = 0;
+    ci->batched = 0;
+    ci->inband = 0;
+    ci->kernel_rate = 0;
+    ci->pace_rate = 0;
+    ci->is_deferred = 0;
+    ci->img = NULL;
+    ci->entry = NULL;
     ci->filefd = -1;
-    ci->name_len = 0;
     ci->remain = 0;
     ci->offset = 0;
-    ci->filename = NULL;
+    if (adaptive_f) {
+      ci->turn.state = ADP_IDLE;
+      ci->turn.class = 2;
+      ci->turn.quantum = 0;
+      pthread_cond_init(&ci->turn.turn, &adp_condattr);
+    }
     /* DO WORK */
     verbose("Thread-%d: Got client %d at %s.", t->id, t->cid, t->addr);
+    metrics_add(M_CONNECTIONS, 1);
+    accesslog_add(t->addr, t->cid, "ACCEPT", NULL, 0, 0);
     if (adaptive_f)
-      snprintf(send_buf, BUFFER_SIZE, "HELLO:%d:%d\n",t->cid,adaptiveport);
+      snprintf(send_buf, BUFFER_SIZE, "HELLO:%d:%d:SPEED\n",t->cid,adaptiveport);
     else
       snprintf(send_buf, BUFFER_SIZE, "HELLO:%d\n",t->cid);
     r = send(t->socketfd, send_buf, strlen(send_buf),0);
     if (r == -1) {
       verbose("Thread-%d: send1: %s", t->id, strerror(errno));
+      metrics_add(M_ERR_SEND, 1);
       close(t->socketfd);
-      executor_thread_expire(t);
+      if (adaptive_f)
+        pthread_cond_destroy(&ci->turn.turn);
+      mempool_put(&clientinfo_pool, ci);
+      executor_thread_exit(t);
       pthread_exit(NULL);
       return NULL;
     }
     pthread_cleanup_push(handle_cleanup, (void *)ci);
     for (;;) {
-      if (pool.shutdown) {
-        executor_thread_shutdown(t);
+      if (pool->shutdown) {
+        executor_thread_exit(t);
         pthread_exit(NULL);
         return NULL;
       }
-      /* Get client input */
-      memset(ci->buffer, 0, BUFFER_SIZE);
-      r = recv(t->socketfd, ci->buffer, BUFFER_SIZE-1, 0);
-      if (r == -1) {
-        verbose("Thread-%d: recv: error: %s", t->id, strerror(errno));
-        break;
-      } else if (r == 0) {
-        verbose("Thread-%d: Client %d disconnected.", t->id, t->cid);
-        if (!verbose_f)
-          fprintf(stderr, "[%s] Disconnect\n", t->addr);
-        break;
-      }
-      /* else got data */
-      ci->buffer[r] = '\0';
-      if (ci->buffer[r-1] != '\n') {
-        snprintf(send_buf, BUFFER_SIZE, "ERROR:Internal Server Error\n");
-        verbose("Thread-%d: Illegal or corrupted client command", t->id);
-        r = send(t->socketfd, send_buf, strlen(send_buf),0);
+      /* Get client input, one line per request. Clients may pipeline
+         several requests, anything after the line waits in ci->buffer. */
+      if ((len = frame_line(ci)) == 0) {
+        if (ci->used == BUFFER_SIZE - 1) {
+          overlong_request(ci, who, send_buf);
+          r = send(t->socketfd, send_buf, strlen(send_buf), more_replies(ci) ? MSG_MORE : 0);
+          access_end(ci, send_buf);
+          if (r == -1) {
+            verbose("Thread-%d: send(2): %s", t->id, strerror(errno));
+            metrics_add(M_ERR_SEND, 1);
+            executor_thread_exit(t);
+            pthread_exit(NULL);
+            return NULL;
+          }
+          continue;
+        }
+        r = recv(t->socketfd, ci->buffer + ci->used, BUFFER_SIZE-1-ci->used, 0);
         if (r == -1) {
-          verbose("Thread-%d: send(2): %s", t->id, strerror(errno));
-          executor_thread_expire(t);
-          pthread_exit(NULL);
-          return NULL;
+          verbose("Thread-%d: recv: error: %s", t->id, strerror(errno));
+          metrics_add(M_ERR_RECV, 1);
+          break;
+        } else if (r == 0) {
+          verbose("Thread-%d: Client %d disconnected.", t->id, t->cid);
+          access_disconnect(ci);
+          break;
         }
+        ci->used += r;
         continue;
       }
-      trim_in_place(ci->buffer);
-      verbose("Thread-%d: Got input \"%s\" from client.", t->id, ci->buffer);
-      if (contains_parent_path(ci->buffer)) {
-        snprintf(send_buf, BUFFER_SIZE, "ERROR:Illegal path\n");
-        verbose("Thread-%d: Parent path forbidden.", t->id);
-        r = send(t->socketfd, send_buf, strlen(send_buf),0);
+      r = open_request(ci, ci->buffer, who, send_buf);
+      consume_line(ci, len);
+      if (r == 1) {
+        continue;
+      } else if (r == -1) {
+        r = send(t->socketfd, send_buf, strlen(send_buf), more_replies(ci) ? MSG_MORE : 0);
+        access_end(ci, send_buf);
         if (r == -1) {
           verbose("Thread-%d: send(3): %s", t->id, strerror(errno));
-          executor_thread_expire(t);
+          metrics_add(M_ERR_SEND, 1);
+          executor_thread_exit(t);
           pthread_exit(NULL);
           return NULL;
         }
         continue;
-      }
-      ci->name_len = strlen(image_dir) + strlen(ci->buffer)+1;
-      ci->filename = (char *)emalloc(ci->name_len);
-      snprintf(ci->filename, ci->name_len, "%s%s", image_dir, ci->buffer);
-      verbose("Thread-%d: Attempting to open file \"%s\"", t->id, ci->filename);
-      ci->file = fopen(ci->filename, "rb");
-      efree(ci->filename);
-      ci->filename = NULL;
-      if (!ci->file) {
-        msg = strerror(errno);
-        snprintf(send_buf, BUFFER_SIZE, "ERROR:%s\n", msg);
-        verbose("Thread-%d: fopen: %s", t->id, msg);
-        r = send(t->socketfd, send_buf, strlen(send_buf),0);
-        if (r == -1) {
-          verbose("Thread-%d: send(4): %s", t->id, strerror(errno));
-          executor_thread_expire(t);
-          pthread_exit(NULL);
-          return NULL;
-        }
       } else {
-        verbose("Thread-%d: Found file.", t->id);
-        ci->filefd = fileno(ci->file);
-        fstat(ci->filefd, &ci->st);
-        if (S_ISDIR (ci->st.st_mode)) {
-          snprintf(send_buf, BUFFER_SIZE, "ERROR:File is a directory\n");
-          verbose("Thread-%d: File is a directory.", t->id);
-          r = send(t->socketfd, send_buf, strlen(send_buf),0);
-          if (r == -1) {
-            verbose("Thread-%d: send(5): %s", t->id, strerror(errno));
-            executor_thread_expire(t);
-            pthread_exit(NULL);
-            return NULL;
-          }
-          continue;
-        }
-        snprintf(send_buf, BUFFER_SIZE, "FILE:%ld\n", (long)ci->st.st_size);
-        r = send(t->socketfd, send_buf, strlen(send_buf),0);
+        /* Let the header share a segment with the start of the body */
+        r = send(t->socketfd, send_buf, strlen(send_buf),
+          (ci->remain > 0 || more_replies(ci)) ? MSG_MORE : 0);
         if (r == -1) {
-          verbose("Thread-%d: send(6): %s", t->id, strerror(errno));
-          executor_thread_expire(t);
+          verbose("Thread-%d: send(4): %s", t->id, strerror(errno));
+          metrics_add(M_ERR_SEND, 1);
+          executor_thread_exit(t);
           pthread_exit(NULL);
           return NULL;
         }
-        if (adaptive_f) {
-          /* Wait yo turn to transmit file data */
-          scheduleMe(t->cid);
-        }
+        class = adaptive_f ? getClass(t->cid) : -1;
+        if (pace_f)
+          pace_request(ci, class);
         verbose("Thread-%d: Transmitting to client.", t->id);
-        ci->remain = ci->st.st_size;
-        ci->offset = 0;
         ssize_t sent;
-        while (ci->remain > 0) {
-          sent = sendfile(t->socketfd, ci->filefd, &ci->offset, ci->remain);
+        long wait;
+        struct timespec ts;
+        struct pollfd pfd;
+        /* Adaptive bodies go out a grant at a time and must not hold a
+           grant while the socket is full */
+        if (adaptive_f)
+          fcntl(t->socketfd, F_SETFL, fcntl(t->socketfd, F_GETFL, 0) | O_NONBLOCK);
+        while ((ci->entry || ci->filefd != -1) && ci->remain > 0) {
+          if ((len = pace_len(ci, &wait)) == 0) {
+            ts.tv_sec = wait / 1000000000L;
+            ts.tv_nsec = wait % 1000000000L;
+            start = metrics_now_ns();
+            nanosleep(&ts, NULL);
+            trace_request(ci, "paced", start);
+            continue;
+          }
+          if (ci->inband)
+            absorb_speeds(ci, who);
+          if (adaptive_f) {
+            /* Wait yo turn to transmit the next grant */
+            if (ci->turn.state != ADP_GRANTED) {
+              start = metrics_now_ns();
+              turn_class = scheduleMe(&ci->turn, t->cid);
+              if ((e = trace_request(ci, "wait", start)) != NULL)
+                e->class = turn_class;
+            }
+            if (len > (size_t)ci->turn.quantum)
+              len = ci->turn.quantum;
+          }
+          start = metrics_now_ns();
+          if (ci->entry)
+            sent = send(t->socketfd, ci->entry->data + ci->offset, len, MSG_NOSIGNAL);
+          else
+            sent = sendfile(t->socketfd, ci->filefd, &ci->offset, len);
+          err = errno;
+          if (sent > 0) {
+            metrics_since(M_SEND_US, start);
+            count_sent(ci, sent);
+            if ((e = trace_request(ci, "send", start)) != NULL)
+              e->bytes = sent;
+          }
+          pace_unused(ci, len, sent);
+          if (adaptive_f) {
+            unexpectMe(&ci->turn, sent > 0 ? sent : 0);
+            if (turn_class != class && pace_f)
+              pace_request(ci, turn_class);
+            class = turn_class;
+            if (sent == -1 && (err == EAGAIN || err == EWOULDBLOCK)) {
+              yieldMe(&ci->turn);
+              pfd.fd = t->socketfd;
+              pfd.events = POLLOUT;
+              if (poll(&pfd, 1, ADP_SEND_TIMEOUT_MS) != 0)
+                continue;
+              verbose("Thread-%d: Client %d took nothing for %dms, dropping it.",
+                t->id, t->cid, ADP_SEND_TIMEOUT_MS);
+              metrics_add(M_ERR_SEND, 1);
+              shutdown(t->socketfd, SHUT_RDWR);
+              break;
+            }
+          }
+          errno = err;
           if (sent == -1) {
-            verbose("Thread-%d: sendfile: %s", t->id, strerror(errno));
+            verbose("Thread-%d: send(5): %s", t->id, strerror(errno));
+            metrics_add(M_ERR_SEND, 1);
             break;
           } else if (sent == 0) {
             fprintf(stderr,"sendfile returned 0? aborting send.\n");
             break;
-          } else if (sent != (ssize_t) ci->remain) {
-            ci->remain -= sent;
-            verbose("Thread-%d: Partial transmission of %ld bytes, retrying %ld from %ld.", t->id, (long)sent, (long)ci->remain, (long)ci->offset);
-          } else {
-            break;
+          } else if (sent != (ssize_t) len) {
+            verbose("Thread-%d: Partial transmission of %ld bytes, retrying %ld from %ld.", t->id, (long)sent, (long)(ci->remain - sent), (long)ci->offset);
           }
+          if (ci->entry)
+            ci->offset += sent;
+          ci->remain -= sent;
+        }
+        if (adaptive_f) {
+          yieldMe(&ci->turn);
+          fcntl(t->socketfd, F_SETFL, fcntl(t->socketfd, F_GETFL, 0) & ~O_NONBLOCK);
+        }
+        access_end(ci, send_buf);
+        if (ci->entry) {
+          cache_release(&cache, ci->entry);
+          ci->entry = NULL;
+        } else {
+          close(ci->filefd);
+          ci->filefd = -1;
         }
-        fclose(ci->file);
-        if (adaptive_f) /* Report back in */
-          unexpectMe();
       }
     }
     close(t->socketfd);
-    efree(ci);
+    if (ci->inband)
+      adaptive_leave(t->cid);
+    if (adaptive_f)
+      pthread_cond_destroy(&ci->turn.turn);
+    mempool_put(&clientinfo_pool, ci);
     pthread_cleanup_pop(0);
-    pthread_mutex_lock(&(t->lock));
-    executor_thread_done(t);
-    while (t->cached && !pool.shutdown) {
-      struct timespec to;
-      memset(&to, 0, sizeof to);
-      to.tv_sec = time(0) + MAX_IDLE_TIME;
-      to.tv_nsec = 0;
-      verbose("Thread-%d: Waiting for next job.", t->id);
-      r = pthread_cond_timedwait(&(t->notify), &(t->lock), &to);
-      if (r == ETIMEDOUT) {
-        verbose("Thread-%d: Idle timeout, marking self for removal.", t->id);
-        if (executor_thread_expire(t)) {
-          continue;
+    t->socketfd = -1;
+  }
+  pthread_exit(NULL);
+  return NULL;
+}
+
+/**
+ Event Loop Connection Engine
+*/
+static evloop_t *loops;
+static int num_loops;
+static int next_loop;
+
+static void raise_fd_limit() {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+      perror("setrlimit");
+  }
+}
+
+int evloop_init(int n) {
+  int i;
+  raise_fd_limit();
+  loops = ALLOC_N(evloop_t, n);
+  num_loops = 0;
+  next_loop = 0;
+  for (i = 0; i < n; ++i) {
+    loops[i].id = i + 1;
+    loops[i].deferred = NULL;
+    if ((loops[i].epollfd = epoll_create1(0)) == -1) {
+      perror("epoll_create1");
+      return -1;
+    }
+    if ((errno = pthread_create(&(loops[i].tid), NULL, evloop_thread, &loops[i])) != 0) {
+      perror("pthread_create");
+      close(loops[i].epollfd);
+      return -1;
+    }
+    ++num_loops;
+  }
+  return 0;
+}
+
+/* Called from the accept thread only. The connection is handed over in the
+   CI_HEADER state with the HELLO line queued, so the owning loop sends it on
+   the first EPOLLOUT and no other thread ever touches ci again. */
+int evloop_add(int socketfd, int cid, char *addr) {
+  struct epoll_event ev;
+  clientinfo *ci;
+  evloop_t *loop;
+  int flags;
+  if (num_loops == 0) {
+    errno = EINTR;
+    return -1;
+  }
+  if ((flags = fcntl(socketfd, F_GETFL, 0)) == -1 ||
+      fcntl(socketfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    return -1;
+  }
+  loop = &loops[next_loop];
+  next_loop = (next_loop + 1) % num_loops;
+  
+  ci = POOL_GET(&clientinfo_pool, clientinfo);
+  ci->parent = NULL;
+  ci->socketfd = socketfd;
+  ci->cid = cid;
+  strncpy(ci->addr, addr, INET6_ADDRSTRLEN);
+  ci->opened = metrics_now_ns();
+  ci->started = 0;
+  ci->traced = 0;
+  ci->used = 0;
+  ci->batch = 0;
+  ci->overlong = 0;
+  ci->batched = 0;
+  ci->kernel_rate = 0;
+  ci->pace_rate = 0;
+  ci->is_deferred = 0;
+  ci->img = NULL;
+  ci->entry = NULL;
+  ci->filefd = -1;
+  ci->remain = 0;
+  ci->offset = 0;
+  ci->out_len = snprintf(ci->out, BUFFER_SIZE, "HELLO:%d\n", cid);
+  ci->out_sent = 0;
+  ci->state = CI_HEADER;
+  
+  /* Edge triggered: evconn_drive() always runs until EAGAIN */
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = (void *)ci;
+  if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, socketfd, &ev) == -1) {
+    mempool_put(&clientinfo_pool, ci);
+    return -1;
+  }
+  return loop->id;
+}
+
+void evloop_shutdown() {
+  int i;
+  for (i = 0; i < num_loops; ++i) {
+    pthread_cancel(loops[i].tid);
+    pthread_join(loops[i].tid, NULL);
+    close(loops[i].epollfd);
+  }
+  num_loops = 0;
+}
+
+/* Parks a paced connection until it has tokens again */
+static void evconn_defer(evloop_t *loop, clientinfo *ci, long wait_ns) {
+  clock_gettime(CLOCK_MONOTONIC, &ci->wake);
+  timespec_add_ns(&ci->wake, wait_ns);
+  if (!ci->is_deferred) {
+    ci->is_deferred = 1;
+    ci->next_deferred = loop->deferred;
+    loop->deferred = ci;
+  }
+}
+
+static void evconn_undefer(evloop_t *loop, clientinfo *ci) {
+  clientinfo **p;
+  for (p = &loop->deferred; *p; p = &(*p)->next_deferred) {
+    if (*p == ci) {
+      *p = ci->next_deferred;
+      break;
+    }
+  }
+  ci->is_deferred = 0;
+}
+
+static void evconn_close(evloop_t *loop, clientinfo *ci) {
+  if (ci->is_deferred)
+    evconn_undefer(loop, ci);
+  if (ci->entry)
+    cache_release(&cache, ci->entry);
+  if (ci->filefd != -1)
+    close(ci->filefd);
+  close(ci->socketfd);
+  mempool_put(&clientinfo_pool, ci);
+}
+
+/* Advances ci through its states until the socket would block or a paced
+   body runs out of tokens. Returns -1 when the connection should be
+   closed. */
+static int evconn_drive(evloop_t *loop, clientinfo *ci, const char *who) {
+  ssize_t r;
+  size_t len;
+  long wait;
+  uint64_t start;
+  for (;;) {
+    switch (ci->state) {
+      case CI_READ:
+        if ((len = frame_line(ci)) > 0) {
+          r = open_request(ci, ci->buffer, who, ci->out);
+          consume_line(ci, len);
+          if (r == 1)
+            break;
+          else if (r == 0 && pace_f)
+            pace_request(ci, -1);
+        } else if (ci->used == BUFFER_SIZE - 1) {
+          overlong_request(ci, who, ci->out);
+        } else {
+          r = recv(ci->socketfd, ci->buffer + ci->used, BUFFER_SIZE - 1 - ci->used, 0);
+          if (r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+              return 0;
+            verbose("%s: recv: error: %s", who, strerror(errno));
+            metrics_add(M_ERR_RECV, 1);
+            return -1;
+          } else if (r == 0) {
+            verbose("%s: Client %d disconnected.", who, ci->cid);
+            access_disconnect(ci);
+            return -1;
+          }
+          ci->used += r;
+          break;
         }
-        pthread_mutex_unlock(&(t->lock));
-        pthread_exit(NULL);
-        return NULL;
+        ci->out_len = strlen(ci->out);
+        ci->out_sent = 0;
+        ci->state = CI_HEADER;
+        break;
+      case CI_HEADER:
+        r = send(ci->socketfd, ci->out + ci->out_sent, ci->out_len - ci->out_sent,
+          MSG_NOSIGNAL | ((ci->filefd != -1 || ci->entry || more_replies(ci)) ? MSG_MORE : 0));
+        if (r == -1) {
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+          verbose("%s: send: %s", who, strerror(errno));
+          metrics_add(M_ERR_SEND, 1);
+          return -1;
+        }
+        ci->out_sent += r;
+        if (ci->out_sent == ci->out_len) {
+          if (ci->filefd != -1)
+            ci->state = CI_SENDFILE;
+          else if (ci->entry)
+            ci->state = CI_SENDBUF;
+          else
+            ci->state = CI_READ;
+          if (ci->state != CI_READ)
+            verbose("%s: Transmitting to client %d.", who, ci->cid);
+          else
+            access_end(ci, ci->out);
+        }
+        break;
+      case CI_SENDBUF:
+        if (ci->remain == 0) {
+          access_end(ci, ci->out);
+          cache_release(&cache, ci->entry);
+          ci->entry = NULL;
+          ci->state = CI_READ;
+          break;
+        }
+        if ((len = pace_len(ci, &wait)) == 0) {
+          evconn_defer(loop, ci, wait);
+          return 0;
+        }
+        start = metrics_now_ns();
+        r = send(ci->socketfd, ci->entry->data + ci->offset, len,
+          MSG_NOSIGNAL | (more_replies(ci) ? MSG_MORE : 0));
+        pace_unused(ci, len, r);
+        if (r == -1) {
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+          verbose("%s: send: %s", who, strerror(errno));
+          metrics_add(M_ERR_SEND, 1);
+          return -1;
+        }
+        metrics_since(M_SEND_US, start);
+        count_sent(ci, r);
+        ci->offset += r;
+        ci->remain -= r;
+        break;
+      case CI_SENDFILE:
+        if (ci->remain == 0) {
+          access_end(ci, ci->out);
+          close(ci->filefd);
+          ci->filefd = -1;
+          ci->state = CI_READ;
+          break;
+        }
+        if ((len = pace_len(ci, &wait)) == 0) {
+          evconn_defer(loop, ci, wait);
+          return 0;
+        }
+        start = metrics_now_ns();
+        r = sendfile(ci->socketfd, ci->filefd, &ci->offset, len);
+        pace_unused(ci, len, r);
+        if (r == -1) {
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+          verbose("%s: sendfile: %s", who, strerror(errno));
+          metrics_add(M_ERR_SEND, 1);
+          return -1;
+        } else if (r == 0) {
+          fprintf(stderr,"sendfile returned 0? aborting send.\n");
+          return -1;
+        }
+        metrics_since(M_SEND_US, start);
+        count_sent(ci, r);
+        ci->remain -= r;
+        break;
+      default:
+        return -1;
+    }
+  }
+}
+
+/* Milliseconds until the first deferred connection is due, -1 if none */
+static int evloop_timeout(evloop_t *loop) {
+  struct timespec now;
+  clientinfo *ci;
+  long ms, min = -1;
+  if (!loop->deferred)
+    return -1;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (ci = loop->deferred; ci; ci = ci->next_deferred) {
+    ms = (ci->wake.tv_sec - now.tv_sec) * 1000 +
+      (ci->wake.tv_nsec - now.tv_nsec + 999999) / 1000000;
+    if (ms < 0)
+      ms = 0;
+    if (min == -1 || ms < min)
+      min = ms;
+  }
+  return (int)min;
+}
+
+/* Drives the deferred connections that are due */
+static void evloop_wake(evloop_t *loop, const char *who) {
+  struct timespec now;
+  clientinfo *ci, *next, *due = NULL;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (ci = loop->deferred; ci; ci = next) {
+    next = ci->next_deferred;
+    if (ci->wake.tv_sec < now.tv_sec ||
+        (ci->wake.tv_sec == now.tv_sec && ci->wake.tv_nsec <= now.tv_nsec)) {
+      evconn_undefer(loop, ci);
+      ci->next_deferred = due;
+      due = ci;
+    }
+  }
+  for (ci = due; ci; ci = next) {
+    next = ci->next_deferred;
+    if (evconn_drive(loop, ci, who) == -1)
+      evconn_close(loop, ci);
+  }
+}
+
+void *evloop_thread(void *arg) {
+  evloop_t *loop = (evloop_t *)arg;
+  struct epoll_event events[EVL_MAX_EVENTS];
+  char who[16];
+  int n, nfds;
+  clientinfo *ci;
+  snprintf(who, sizeof who, "Loop-%d", loop->id);
+  verbose("%s: Started.", who);
+  for (;;) {
+    if ((nfds = epoll_wait(loop->epollfd, events, EVL_MAX_EVENTS, evloop_timeout(loop))) == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      pthread_exit(NULL);
+      return NULL;
+    }
+    for (n = 0; n < nfds; ++n) {
+      ci = (clientinfo *)events[n].data.ptr;
+      if (evconn_drive(loop, ci, who) == -1)
+        evconn_close(loop, ci);
+    }
+    evloop_wake(loop, who);
+  }
+  pthread_exit(NULL);
+  return NULL;
+}
+
+/**
+ io_uring Backend
+*/
+static uring_t ring;
+
+/* A full ring is submitted by uring_get_sqe(). If the kernel takes
+   nothing it is usually holding completions back for want of CQ space,
+   so those are flushed and the submit tried again. */
+static struct io_uring_sqe *ur_sqe(urconn *uc, int op, int fd, int tag) {
+  struct io_uring_sqe *sqe;
+  while ((sqe = uring_get_sqe(&ring)) == NULL) {
+    if ((errno != EBUSY && errno != EAGAIN) || uring_flush(&ring) == -1) {
+      perror("io_uring_enter");
+      global_exit(1);
+    }
+  }
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->user_data = (__u64)(uintptr_t)uc | tag;
+  if (uc)
+    ++uc->inflight;
+  return sqe;
+}
+
+static void ur_arm_accept() {
+  struct io_uring_sqe *sqe = ur_sqe(NULL, IORING_OP_ACCEPT, sockfd, UR_ACCEPT);
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+static void ur_close_fd(int fd) {
+  ur_sqe(NULL, IORING_OP_CLOSE, fd, UR_CLOSE);
+}
+
+static void ur_send_out(urconn *uc) {
+  clientinfo *ci = &uc->ci;
+  struct io_uring_sqe *sqe = ur_sqe(uc, IORING_OP_SEND, ci->socketfd, UR_SEND);
+  sqe->addr = (__u64)(uintptr_t)(ci->out + ci->out_sent);
+  sqe->len = ci->out_len - ci->out_sent;
+  sqe->msg_flags = MSG_NOSIGNAL |
+    ((ci->filefd != -1 || ci->entry || more_replies(ci)) ? MSG_MORE : 0);
+}
+
+static void ur_next_request(urconn *uc);
+
+/* Sends the rest of a cached body, or moves on once it is all out */
+static void ur_send_entry(urconn *uc) {
+  clientinfo *ci = &uc->ci;
+  struct io_uring_sqe *sqe;
+  if (ci->remain == 0) {
+    access_end(ci, ci->out);
+    cache_release(&cache, ci->entry);
+    ci->entry = NULL;
+    ur_next_request(uc);
+    return;
+  }
+  uc->started = metrics_now_ns();
+  sqe = ur_sqe(uc, IORING_OP_SEND, ci->socketfd, UR_SENDBUF);
+  sqe->addr = (__u64)(uintptr_t)(ci->entry->data + ci->offset);
+  sqe->len = ci->remain;
+  sqe->msg_flags = MSG_NOSIGNAL | (more_replies(ci) ? MSG_MORE : 0);
+}
+
+static void ur_reply(urconn *uc) {
+  uc->ci.out_len = strlen(uc->ci.out);
+  uc->ci.out_sent = 0;
+  ur_send_out(uc);
+}
+
+/* Stats fd, or path relative to it, on the ring into uc->stx */
+static void ur_statx(urconn *uc, int fd, const char *path, int flags) {
+  struct io_uring_sqe *sqe;
+  uc->started = metrics_now_ns();
+  sqe = ur_sqe(uc, IORING_OP_STATX, fd, UR_STATX);
+  sqe->addr = (__u64)(uintptr_t)path;
+  sqe->len = STATX_BASIC_STATS;
+  sqe->off = (__u64)(uintptr_t)&uc->stx;
+  sqe->statx_flags = flags;
+}
+
+/* Serves the request from the cache, checking a hit with a statx first,
+   or opens the file with an openat on the ring */
+static void ur_lookup(urconn *uc) {
+  clientinfo *ci = &uc->ci;
+  struct io_uring_sqe *sqe;
+  int r = 1;
+  if (cache_f)
+    r = cache_request(ci, CACHE_NOWAIT | CACHE_NOSTAT, "Ring", ci->out);
+  if (r == 2) {
+    ur_statx(uc, images.dirfd, ci->img->name, 0);
+    return;
+  } else if (r != 1) {
+    ur_reply(uc);
+    return;
+  }
+  verbose("Ring: Attempting to open file \"%s\"", ci->img->name);
+  uc->started = metrics_now_ns();
+  sqe = ur_sqe(uc, IORING_OP_OPENAT, images.dirfd, UR_OPEN);
+  sqe->addr = (__u64)(uintptr_t)ci->img->name;
+  sqe->open_flags = O_RDONLY | O_CLOEXEC;
+}
+
+/* Frames the next request line out of ci->buffer, or reads more input.
+   A name in the image index is opened and stat'd on the ring, and the
+   response line is written once both are done. */
+static void ur_next_request(urconn *uc) {
+  clientinfo *ci = &uc->ci;
+  struct io_uring_sqe *sqe;
+  size_t len;
+  int r;
+  if ((len = frame_line(ci)) > 0) {
+    r = lookup_request(ci, ci->buffer, "Ring", ci->out);
+    consume_line(ci, len);
+    if (r == 1) {
+      ur_next_request(uc);
+      return;
+    } else if (r == -1) {
+      ur_reply(uc);
+      return;
+    }
+    if (pace_f)
+      pace_request(ci, -1); /* Kernel pacing only */
+    if (ci->filefd != -1) {
+      ur_reply(uc); /* STATS */
+      return;
+    }
+    ur_lookup(uc);
+  } else if (ci->used == BUFFER_SIZE - 1) {
+    overlong_request(ci, "Ring", ci->out);
+    ur_reply(uc);
+  } else {
+    sqe = ur_sqe(uc, IORING_OP_RECV, ci->socketfd, UR_RECV);
+    sqe->addr = (__u64)(uintptr_t)(ci->buffer + ci->used);
+    sqe->len = BUFFER_SIZE - 1 - ci->used;
+  }
+}
+
+/* Moves the next chunk file -> pipe -> socket as one linked pair */
+static void ur_splice_chunk(urconn *uc) {
+  clientinfo *ci = &uc->ci;
+  struct io_uring_sqe *sqe;
+  size_t len;
+  if (uc->piped == 0) {
+    len = ci->remain > UR_CHUNK ? UR_CHUNK : ci->remain;
+    sqe = ur_sqe(uc, IORING_OP_SPLICE, uc->pipefd[1], UR_SPLICE_IN);
+    sqe->splice_fd_in = ci->filefd;
+    sqe->splice_off_in = ci->offset;
+    sqe->off = (__u64)-1;
+    sqe->len = len;
+    sqe->flags = IOSQE_IO_LINK;
+  } else {
+    len = uc->piped;
+  }
+  uc->started = metrics_now_ns();
+  sqe = ur_sqe(uc, IORING_OP_SPLICE, ci->socketfd, UR_SPLICE_OUT);
+  sqe->splice_fd_in = uc->pipefd[0];
+  sqe->splice_off_in = (__u64)-1;
+  sqe->off = (__u64)-1;
+  sqe->len = len;
+}
+
+static void ur_file_done(urconn *uc) {
+  access_end(&uc->ci, uc->ci.out);
+  ur_close_fd(uc->ci.filefd);
+  uc->ci.filefd = -1;
+  ur_next_request(uc);
+}
+
+static void ur_open_done(urconn *uc, int res) {
+  clientinfo *ci = &uc->ci;
+  metrics_since(M_OPEN_US, uc->started);
+  if (res < 0) {
+    reply_line(ci, ci->out, "ERROR", strerror(-res), ci->img->name);
+    verbose("Ring: openat: %s", strerror(-res));
+    metrics_add(M_ERR_OPEN, 1);
+  } else {
+    verbose("Ring: Found file.");
+    ci->filefd = res;
+    ur_statx(uc, ci->filefd, "", AT_EMPTY_PATH);
+    return;
+  }
+  ur_reply(uc);
+}
+
+static void ur_statx_done(urconn *uc, int res) {
+  clientinfo *ci = &uc->ci;
+  struct stat st;
+  metrics_since(M_FSTAT_US, uc->started);
+  trace_request(ci, "fstat", uc->started);
+  if (res == 0) {
+    memset(&st, 0, sizeof st);
+    st.st_mode = uc->stx.stx_mode;
+    st.st_ino = uc->stx.stx_ino;
+    st.st_size = uc->stx.stx_size;
+    st.st_mtim.tv_sec = uc->stx.stx_mtime.tv_sec;
+    st.st_mtim.tv_nsec = uc->stx.stx_mtime.tv_nsec;
+  }
+  if (ci->entry && !cache_check(&cache, ci->entry, res == 0 ? &st : NULL)) {
+    cache_release(&cache, ci->entry);
+    ci->entry = NULL;
+    if (res == 0) {
+      verbose("Ring: Cached copy is out of date.");
+      ur_lookup(uc);
+      return;
+    }
+  }
+  if (res < 0) {
+    reply_line(ci, ci->out, "ERROR", strerror(-res), ci->img->name);
+    verbose("Ring: statx: %s", strerror(-res));
+    metrics_add(M_ERR_OPEN, 1);
+    if (ci->filefd != -1) {
+      ur_close_fd(ci->filefd);
+      ci->filefd = -1;
+    }
+  } else {
+    file_header(ci, "Ring", ci->out, ci->entry ? NULL : &st);
+  }
+  ur_reply(uc);
+}
+
+static void ur_release(urconn *uc) {
+  clientinfo *ci = &uc->ci;
+  if (ci->entry)
+    cache_release(&cache, ci->entry);
+  if (ci->filefd != -1)
+    ur_close_fd(ci->filefd);
+  ur_close_fd(uc->pipefd[0]);
+  ur_close_fd(uc->pipefd[1]);
+  ur_close_fd(ci->socketfd);
+  mempool_put(&urconn_pool, uc);
+}
+
+static void ur_accept(int fd, int cid) {
+  struct sockaddr_storage cli_addr;
+  socklen_t clilen = sizeof(cli_addr);
+  urconn *uc = POOL_GET(&urconn_pool, urconn);
+  clientinfo *ci = &uc->ci;
+  ci->parent = NULL;
+  ci->socketfd = fd;
+  ci->cid = cid;
+  ci->addr[0] = '\0';
+  if (getpeername(fd, (struct sockaddr *)&cli_addr, &clilen) == 0)
+    inet_ntop(cli_addr.ss_family, get_in_addr((struct sockaddr *)&cli_addr),
+      ci->addr, sizeof ci->addr);
+  ci->opened = metrics_now_ns();
+  ci->started = 0;
+  ci->traced = 0;
+  ci->used = 0;
+  ci->batch = 0;
+  ci->overlong = 0;
+  ci->batched = 0;
+  ci->kernel_rate = 0;
+  ci->pace_rate = 0;
+  ci->is_deferred = 0;
+  ci->img = NULL;
+  ci->entry = NULL;
+  ci->filefd = -1;
+  ci->remain = 0;
+  ci->offset = 0;
+  uc->inflight = 0;
+  uc->failed = 0;
+  uc->piped = 0;
+  if (pipe(uc->pipefd) == -1) {
+    perror("pipe");
+    accesslog_add(ci->addr, cid, "REJECT", NULL, 0, 0);
+    metrics_add(M_ERR_REJECTED, 1);
+    close(fd);
+    mempool_put(&urconn_pool, uc);
+    return;
+  }
+  accesslog_add(ci->addr, cid, "ACCEPT", NULL, 0, 0);
+  verbose("Ring: Got client %d at %s.", cid, ci->addr);
+  metrics_add(M_CONNECTIONS, 1);
+  snprintf(ci->out, BUFFER_SIZE, "HELLO:%d\n", cid);
+  ur_reply(uc);
+}
+
+static void ur_complete(struct io_uring_cqe *cqe) {
+  static int cid = 1;
+  int tag = (int)(cqe->user_data & UR_TAG_MASK);
+  urconn *uc = (urconn *)(uintptr_t)(cqe->user_data & ~(__u64)UR_TAG_MASK);
+  clientinfo *ci;
+  int res = cqe->res;
+  if (tag == UR_ACCEPT) {
+    if (res >= 0)
+      ur_accept(res, cid++);
+    else
+      fprintf(stderr, "accept: %s\n", strerror(-res));
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+      ur_arm_accept();
+    return;
+  } else if (tag == UR_CLOSE) {
+    return;
+  }
+  ci = &uc->ci;
+  --uc->inflight;
+  if (!uc->failed) {
+    switch (tag) {
+      case UR_RECV:
+        if (res == 0) {
+          verbose("Ring: Client %d disconnected.", ci->cid);
+          access_disconnect(ci);
+          uc->failed = 1;
+        } else if (res < 0) {
+          verbose("Ring: recv: error: %s", strerror(-res));
+          metrics_add(M_ERR_RECV, 1);
+          uc->failed = 1;
+        } else {
+          ci->used += res;
+          ur_next_request(uc);
+        }
+        break;
+      case UR_SEND:
+        if (res < 0) {
+          verbose("Ring: send: %s", strerror(-res));
+          metrics_add(M_ERR_SEND, 1);
+          uc->failed = 1;
+          break;
+        }
+        ci->out_sent += res;
+        if (ci->out_sent < ci->out_len)
+          ur_send_out(uc);
+        else if (ci->entry)
+          ur_send_entry(uc);
+        else if (ci->filefd == -1) {
+          access_end(ci, ci->out);
+          ur_next_request(uc);
+        }
+        else if (ci->remain > 0)
+          ur_splice_chunk(uc);
+        else
+          ur_file_done(uc);
+        break;
+      case UR_SENDBUF:
+        if (res <= 0) {
+          verbose("Ring: send: %s", res ? strerror(-res) : "socket closed");
+          metrics_add(M_ERR_SEND, 1);
+          uc->failed = 1;
+          break;
+        }
+        metrics_since(M_SEND_US, uc->started);
+        count_sent(ci, res);
+        ci->offset += res;
+        ci->remain -= res;
+        ur_send_entry(uc);
+        break;
+      case UR_OPEN:
+        ur_open_done(uc, res);
+        break;
+      case UR_STATX:
+        ur_statx_done(uc, res);
+        break;
+      case UR_SPLICE_IN:
+        if (res <= 0) {
+          verbose("Ring: splice: %s", res ? strerror(-res) : "unexpected end of file");
+          uc->failed = 1;
+          break;
+        }
+        uc->piped += res;
+        ci->offset += res;
+        break;
+      case UR_SPLICE_OUT:
+        if (res == -ECANCELED) {
+          /* Short file -> pipe splice broke the link, resent below */
+        } else if (res <= 0) {
+          verbose("Ring: splice: %s", res ? strerror(-res) : "socket closed");
+          metrics_add(M_ERR_SEND, 1);
+          uc->failed = 1;
+          break;
+        } else {
+          metrics_since(M_SEND_US, uc->started);
+          count_sent(ci, res);
+          uc->piped -= res;
+          ci->remain -= res;
+        }
+        if (uc->inflight > 0)
+          break;
+        if (ci->remain > 0)
+          ur_splice_chunk(uc);
+        else
+          ur_file_done(uc);
+        break;
+      default:
+        break;
+    }
+  }
+  if (uc->failed && uc->inflight == 0)
+    ur_release(uc);
+}
+
+static void uring_serve() {
+  struct io_uring_cqe *cqe, done;
+  int r;
+  raise_fd_limit();
+  if (uring_init(&ring, UR_ENTRIES) == -1) {
+    perror("io_uring_setup");
+    global_exit(1);
+  }
+  fprintf(stderr, "Serving from io_uring.\n");
+  ur_arm_accept();
+  for (;;) {
+    if (uring_submit(&ring, 1) == -1) {
+      perror("io_uring_enter");
+      global_exit(1);
+    }
+    /* Each CQE is copied out and its slot freed before it is handled, so
+       completions parked on the overflow list have room to come back */
+    do {
+      while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+        done = *cqe;
+        uring_cqe_seen(&ring);
+        ur_complete(&done);
       }
+    } while ((r = uring_flush(&ring)) == 1);
+    if (r == -1) {
+      perror("io_uring_enter");
+      global_exit(1);
     }
-    pthread_mutex_unlock(&(t->lock));
   }
-  pthread_exit(NULL);
-  return NULL;
 }
 
-/**
-  Adaptive Scheduler Service
-*/
-static void initialize_adaptive() {
-  adaptive_d.clients = NULL;
-  adaptive_d.num_clients = 0;
-  adaptive_d.capacity = 0;
-  adaptive_d.released = 0;
-  adaptive_d.next = 0;
-  adaptive_d.high_c = 0;
-  adaptive_d.med_c = 0;
-  adaptive_d.low_c = 0;
-  pthread_mutex_init(&(adaptive_d.lock), NULL);
-  pthread_mutex_init(&(adaptive_d.high_l), NULL);
-  pthread_cond_init(&(adaptive_d.high_n), NULL);
-  pthread_mutex_init(&(adaptive_d.med_l), NULL);
-  pthread_cond_init(&(adaptive_d.med_n), NULL);
-  pthread_mutex_init(&(adaptive_d.low_l), NULL);
-  pthread_cond_init(&(adaptive_d.low_n), NULL);
+/**
+  Adaptive Scheduler Service
+*/
+static void initialize_adaptive(const int *weights, int max_wait_ms, int senders) {
+  int i;
+  prioidx_init(&adaptive_d.clients);
+  for (i = 0; i < 3; ++i) {
+    adaptive_d.head[i] = NULL;
+    adaptive_d.tail[i] = NULL;
+    adaptive_d.deficit[i] = 0;
+    adaptive_d.weight[i] = weights[i];
+  }
+  adaptive_d.turn = 0;
+  adaptive_d.active = 0;
+  adaptive_d.senders = senders;
+  adaptive_d.max_wait_us = max_wait_ms * 1000L;
+  memset(adaptive_d.wait, 0, sizeof adaptive_d.wait);
+  adaptive_d.promoted = 0;
+  adaptive_d.expired = 0;
+  pthread_mutex_init(&(adaptive_d.lock), NULL);
+  LOCK_NAME(&(adaptive_d.lock), "adaptive_d.lock");
+  pthread_condattr_init(&adp_condattr);
+  pthread_condattr_setclock(&adp_condattr, CLOCK_MONOTONIC);
+}
+
+/* BEGIN NEED adaptive_d.lock */
+static int getClientpriIndById(int cid) {
+  return prioidx_rank(&adaptive_d.clients, cid);
+}
+
+static void removeClientpri(int cid) {
+  if (prioidx_remove(&adaptive_d.clients, cid) == -1)
+    verbose("Warning: Attempted removal of non-existant client %d.", cid);
+}
+
+static void updateClientpri(int cid, int speed) {
+  speed = speed < 1 ? 1 : speed; /* Lower bound */
+  prioidx_update(&adaptive_d.clients, cid, speed);
+}
+
+static void updateCutoffs() {
+  float c;
+  c = (float)adaptive_d.clients.count;
+  adaptive_d.high_t = (int)ceilf(c * HIGH_PRI_PCT);
+  adaptive_d.med_t = adaptive_d.high_t + (int)ceilf(c * MED_PRI_PCT);
+}
+
+/* Priority class of cid by its rank among the reporting clients */
+static int sched_class(int cid) {
+  int i = getClientpriIndById(cid);
+  if (i == -1)
+    i = adaptive_d.clients.count; /* lowest priority for clients who have not checked in with adaptive server */
+  /* Sorting hat */
+  if (i < adaptive_d.high_t)
+    return 0;
+  else if (i < adaptive_d.med_t)
+    return 1;
+  return 2;
+}
+
+static long waited_us(const adp_waiter *w, const struct timespec *now) {
+  return (now->tv_sec - w->since.tv_sec) * 1000000L +
+    (now->tv_nsec - w->since.tv_nsec) / 1000;
+}
+
+/* Queues w in its class, which is kept oldest first */
+static void sched_enqueue(adp_waiter *w) {
+  adp_waiter **p, *t = adaptive_d.tail[w->class];
+  w->next = NULL;
+  if (!t || waited_us(t, &w->since) >= 0) {
+    if (t)
+      t->next = w;
+    else
+      adaptive_d.head[w->class] = w;
+    adaptive_d.tail[w->class] = w;
+    return;
+  }
+  for (p = &adaptive_d.head[w->class]; waited_us(*p, &w->since) >= 0; p = &(*p)->next)
+    ;
+  w->next = *p;
+  *p = w;
+}
+
+static adp_waiter *sched_dequeue(int c) {
+  adp_waiter *w = adaptive_d.head[c];
+  if ((adaptive_d.head[c] = w->next) == NULL)
+    adaptive_d.tail[c] = NULL;
+  return w;
 }
 
-/* BEGIN NEED adaptive_d.lock */
-static int getClientpriIndById(int cid) {
-  if (adaptive_d.num_clients == 0)
-    return -1;
-  int i;
-  for (i = 0; i < adaptive_d.num_clients; i++) {
-    if (adaptive_d.clients[i].cid == cid)
-      return i;
+/* Promotes waiters one class for every max_wait/ADP_AGE_STEPS they have
+   waited, so a busy high class cannot starve the others */
+static void sched_age(const struct timespec *now) {
+  long step = adaptive_d.max_wait_us / ADP_AGE_STEPS;
+  adp_waiter *w;
+  int c;
+  for (c = 1; c < 3; ++c) {
+    while ((w = adaptive_d.head[c]) != NULL &&
+        waited_us(w, now) >= step * (w->origin - c + 1)) {
+      sched_dequeue(c);
+      w->class = c - 1;
+      sched_enqueue(w);
+      ++adaptive_d.promoted;
+    }
   }
-  return -1;
 }
 
-static void removeClientpri(int cid) {
-  int i = getClientpriIndById(cid);
-  if (i == -1) {
-    verbose("Warning: Attempted removal of non-existant client %d.", cid);
+/* Deficit round robin across the classes: a class keeps the turn while it
+   has waiters and credit, earning weight * ADP_CHUNK bytes of credit each
+   time the turn comes back to it. A waiter that reaches the maximum wait
+   goes first regardless, with *late set, and is not charged for it.
+   Returns the next waiter to grant, NULL only when none are queued. */
+static adp_waiter *sched_pick(const struct timespec *now, int *late_p) {
+  adp_waiter *w;
+  int c, late = -1;
+  *late_p = 0;
+  sched_age(now);
+  for (c = 0; c < 3; ++c) {
+    if ((w = adaptive_d.head[c]) != NULL && waited_us(w, now) >= adaptive_d.max_wait_us &&
+        (late == -1 || waited_us(w, &adaptive_d.head[late]->since) > 0))
+      late = c;
+  }
+  if (late != -1) {
+    ++adaptive_d.expired;
+    *late_p = 1;
+    return sched_dequeue(late);
+  }
+  if (!adaptive_d.head[0] && !adaptive_d.head[1] && !adaptive_d.head[2])
+    return NULL;
+  /* Ends: a charged class is never more than one quantum in debt, and
+     every pass adds a quantum to each class with waiters */
+  for (;;) {
+    c = adaptive_d.turn;
+    if (adaptive_d.head[c] && adaptive_d.deficit[c] > 0)
+      return sched_dequeue(c);
+    if (!adaptive_d.head[c])
+      adaptive_d.deficit[c] = 0; /* Idle classes do not bank credit */
+    adaptive_d.turn = (c + 1) % 3;
+    c = adaptive_d.turn;
+    if (adaptive_d.head[c])
+      adaptive_d.deficit[c] += (long)adaptive_d.weight[c] * ADP_CHUNK;
+  }
+}
+
+static void sched_record(adp_waiter *w, const struct timespec *now) {
+  adp_stats *st = &adaptive_d.wait[w->origin];
+  long us = waited_us(w, now);
+  int b = 0;
+  us = us < 0 ? 0 : us;
+  ++st->count;
+  st->total_us += us;
+  if ((unsigned long)us > st->max_us)
+    st->max_us = us;
+  while (b < ADP_HIST_BUCKETS - 1 && (1L << b) <= us)
+    ++b;
+  ++st->hist[b];
+  metrics_observe(M_ADP_WAIT_US + w->origin, us);
+}
+
+/* Grants the next waiters a quantum of weight * ADP_CHUNK bytes each,
+   charged to their class up front unless late, while fewer than senders
+   hold one */
+static void sched_dispatch() {
+  struct timespec now;
+  adp_waiter *w;
+  int late;
+  if (adaptive_d.active >= adaptive_d.senders)
     return;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  while (adaptive_d.active < adaptive_d.senders && (w = sched_pick(&now, &late)) != NULL) {
+    sched_record(w, &now);
+    w->quantum = (long)adaptive_d.weight[w->class] * ADP_CHUNK;
+    w->charged = !late;
+    if (w->charged)
+      adaptive_d.deficit[w->class] -= w->quantum;
+    ++adaptive_d.active;
+    w->state = ADP_GRANTED;
+    pthread_cond_signal(&w->turn);
   }
-  if (i < adaptive_d.num_clients - 1) {
-    /* [ x x i x x ] => [ x x x x ] */
-    memmove(&adaptive_d.clients[i], &adaptive_d.clients[i+1], (adaptive_d.num_clients-i-1)*sizeof(clientpri));
-  } /* else tail of list */
-  --adaptive_d.num_clients;
 }
 
-static void updateClientpri(int cid, int speed) {
-  clientpri *t;
-  int i, s, clientInd;
-  clientInd = getClientpriIndById(cid);
-  speed = speed < 1 ? 1 : speed; /* Lower bound */
-  i = clientInd;
-  if (clientInd != -1) {
-    s = adaptive_d.clients[i].speed;
-    adaptive_d.clients[i].speed = speed;
-    if (speed > s && i < adaptive_d.num_clients - 1) {
-      do {
-        ++i;
-      } while (i < adaptive_d.num_clients && adaptive_d.clients[i].speed <= speed);
-      /* <= for FCFS ordering, new client of same speed is ordered after existing */
-      --i;
-      if (i != clientInd) {
-        t = ALLOC(clientpri);
-        memcpy(t, &adaptive_d.clients[clientInd], sizeof(clientpri));
-        memmove(&adaptive_d.clients[clientInd], &adaptive_d.clients[clientInd+1], (i-clientInd)*sizeof(clientpri));
-        memcpy(&adaptive_d.clients[i], t, sizeof(clientpri));
-        efree(t);
-      }
-    } else if (speed < s && i > 0) {
-      do {
-        --i;
-      } while (i >= 0 && adaptive_d.clients[i].speed > speed);
-      ++i;
-      if (i != clientInd) {
-        t = ALLOC(clientpri);
-        memcpy(t, &adaptive_d.clients[clientInd], sizeof(clientpri));
-        memmove(&adaptive_d.clients[i+1], &adaptive_d.clients[i], (clientInd-i)*sizeof(clientpri));
-        memcpy(&adaptive_d.clients[i], t, sizeof(clientpri));
-        efree(t);
-      }
-    }
-  } else {
-    if (adaptive_d.capacity < adaptive_d.num_clients + 1) {
-      adaptive_d.clients = (clientpri *)erealloc(adaptive_d.clients, (adaptive_d.capacity + CLI_STOR_INCR)*sizeof(clientpri));
-      adaptive_d.capacity += CLI_STOR_INCR;
-    }
-    /* i = -1 */
-    do {
-      ++i;
-    } while (i < adaptive_d.num_clients && adaptive_d.clients[i].speed <= speed);
-    if (i != adaptive_d.num_clients)
-      memmove(&adaptive_d.clients[i+1], &adaptive_d.clients[i], (adaptive_d.num_clients - i)*sizeof(clientpri));
-    /* memset(&adaptive_d.clients[i], 0, sizeof(clientpri)); */
-    adaptive_d.clients[i].cid = cid;
-    adaptive_d.clients[i].speed = speed;
-    ++adaptive_d.num_clients;
+/* Ends w's grant, refunding what it left unsent to its class */
+static void sched_release(adp_waiter *w) {
+  if (w->charged && w->quantum > 0)
+    adaptive_d.deficit[w->class] += w->quantum;
+  w->quantum = 0;
+  w->state = ADP_IDLE;
+  --adaptive_d.active;
+  sched_dispatch();
+}
+/* When w is next due a promotion, or to be served out of turn */
+static void sched_deadline(const adp_waiter *w, struct timespec *at) {
+  struct timespec now;
+  long step = adaptive_d.max_wait_us / ADP_AGE_STEPS, waited, us;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  waited = waited_us(w, &now);
+  us = (waited / step + 1) * step;
+  if (waited < adaptive_d.max_wait_us && us > adaptive_d.max_wait_us)
+    us = adaptive_d.max_wait_us;
+  at->tv_sec = w->since.tv_sec + us / 1000000;
+  at->tv_nsec = w->since.tv_nsec + us % 1000000 * 1000;
+  if (at->tv_nsec >= 1000000000L) {
+    ++at->tv_sec;
+    at->tv_nsec -= 1000000000L;
   }
 }
+/* END need adaptive_d.lock */
 
-static void updateCutoffs() {
-  float c;
-  c = (float)adaptive_d.num_clients;
-  adaptive_d.high_t = (int)ceilf(c * HIGH_PRI_PCT);
-  adaptive_d.med_t = adaptive_d.high_t + (int)ceilf(c * MED_PRI_PCT);
+static int getClass(int cid) {
+  int class;
+  pthread_mutex_lock(&(adaptive_d.lock));
+  class = sched_class(cid);
+  pthread_mutex_unlock(&(adaptive_d.lock));
+  return class;
 }
 
-static int sched_checkrelease() {
-  int i, n, rc, release = -1;
-  if (adaptive_d.released == 0) {
-    /* Oh boy everyone is back lets let the next wave go */
-    for (i = 0; i < 3; ++i) {
-      switch(adaptive_d.next) {
-        case 0:
-          n = adaptive_d.high_c;
-          rc = 0;
-          adaptive_d.high_c = 0;
-          break;
-        case 1:
-          n = adaptive_d.med_c;
-          rc = 1;
-          adaptive_d.med_c = 0;
-          break;
-        case 2:
-          n = adaptive_d.low_c;
-          rc = 2;
-          adaptive_d.low_c = 0;
-          break;
-        default:
-          break;
-      }
-      ++adaptive_d.next;
-      if (adaptive_d.next > 2) adaptive_d.next = 0;
-      if (n > 0) {
-        adaptive_d.released = n;
-        adaptive_d.current = rc;
-        release = rc;
-        break;
-      } /* else if n = 0 then nobody in that priority class is waiting, go to next one */
-    }
+static void unlock_adaptive(void *arg) {
+  pthread_mutex_unlock(&(adaptive_d.lock));
+}
+
+/* Queues w in the class of cid and waits for a grant, unless it still
+   holds one. Returns the class it was sorted into. */
+static int scheduleMe(adp_waiter *w, int cid) {
+  struct timespec deadline;
+  int class;
+  if (w->state == ADP_GRANTED) /* Only the owner ends its grant */
+    return w->origin;
+  pthread_mutex_lock(&(adaptive_d.lock));
+  class = sched_class(cid);
+  w->class = class;
+  w->origin = class;
+  w->state = ADP_QUEUED;
+  clock_gettime(CLOCK_MONOTONIC, &w->since);
+  sched_enqueue(w);
+  sched_dispatch();
+  pthread_cleanup_push(unlock_adaptive, NULL);
+  /* Wakes at each aging step too, so promotions and the maximum wait
+     hold without other threads enqueueing or releasing */
+  while (w->state != ADP_GRANTED) {
+    sched_deadline(w, &deadline);
+    if (pthread_cond_timedwait(&w->turn, &(adaptive_d.lock), &deadline) == ETIMEDOUT)
+      sched_dispatch();
   }
-  return release;
+  pthread_cleanup_pop(1);
+  return class;
 }
-/* END need adaptive_d.lock */
 
-static void unexpectMe() {
-  /* I'm done */
-  int release;
+/* Gives the grant back early, when the socket is full or the body done */
+static void yieldMe(adp_waiter *w) {
   pthread_mutex_lock(&(adaptive_d.lock));
-  --adaptive_d.released;
-  release = sched_checkrelease();
-  /* Release next group */
-  switch (release) {
-    case 0:
-      verbose("Adaptive: Unexpect: Releasing high priority (%d)", adaptive_d.released);
-      pthread_mutex_lock(&(adaptive_d.high_l));
-      pthread_cond_broadcast(&(adaptive_d.high_n));
-      pthread_mutex_unlock(&(adaptive_d.high_l));
-      break;
-    case 1:
-      verbose("Adaptive: Unexpect: Releasing med priority (%d)", adaptive_d.released);
-      pthread_mutex_lock(&(adaptive_d.med_l));
-      pthread_cond_broadcast(&(adaptive_d.med_n));
-      pthread_mutex_unlock(&(adaptive_d.med_l));
-      break;
-    case 2:
-      verbose("Adaptive: Unexpect: Releasing low priority (%d)", adaptive_d.released);
-      pthread_mutex_lock(&(adaptive_d.low_l));
-      pthread_cond_broadcast(&(adaptive_d.low_n));
-      pthread_mutex_unlock(&(adaptive_d.low_l));
-      break;
-    default:
-      break;
+  if (w->state == ADP_GRANTED)
+    sched_release(w);
+  pthread_mutex_unlock(&(adaptive_d.lock));
+}
+
+/* Takes sent bytes off w's grant, giving it back once used up */
+static void unexpectMe(adp_waiter *w, size_t sent) {
+  if ((w->quantum -= (long)sent) > 0)
+    return;
+  yieldMe(w);
+}
+
+/* Withdraws w from the scheduler wherever it is, for cancelled threads */
+static void abandonMe(adp_waiter *w) {
+  adp_waiter **p, *q;
+  int class;
+  pthread_mutex_lock(&(adaptive_d.lock));
+  class = w->class;
+  if (w->state == ADP_GRANTED) {
+    sched_release(w);
+  } else if (w->state == ADP_QUEUED) {
+    for (p = &adaptive_d.head[class]; *p; p = &(*p)->next) {
+      if (*p == w) {
+        *p = w->next;
+        break;
+      }
+    }
+    adaptive_d.tail[class] = NULL;
+    for (q = adaptive_d.head[class]; q; q = q->next)
+      adaptive_d.tail[class] = q;
   }
+  w->state = ADP_IDLE;
   pthread_mutex_unlock(&(adaptive_d.lock));
 }
 
-static int getCurrent() {
+/* Speed update from a client on its main connection */
+static void adaptive_speed(int cid, int speed, int joined) {
   pthread_mutex_lock(&(adaptive_d.lock));
-  int current = adaptive_d.current;
+  updateClientpri(cid, speed);
+  if (joined)
+    updateCutoffs();
   pthread_mutex_unlock(&(adaptive_d.lock));
-  return current;
 }
 
-static void scheduleMe(int cid) {
-  int i, which, release;
+static void adaptive_leave(int cid) {
   pthread_mutex_lock(&(adaptive_d.lock));
-  i = getClientpriIndById(cid);
-  if (i == -1)
-    i = adaptive_d.num_clients; /* lowest priority for clients who have not checked in with adaptive server */
-  
-  /* Sorting hat */
-  if (i < adaptive_d.high_t) {
-    which = 0;
-  } else if (i < adaptive_d.med_t) {
-    which = 1;
-  } else {
-    which = 2;
-  }
-  switch (which) {
-    case 0:
-      ++adaptive_d.high_c;
-      break;
-    case 1:
-      ++adaptive_d.med_c;
-      break;
-    case 2:
-      ++adaptive_d.low_c;
-      break;
-    default:
-      break;
-  }
-  
-  /* Are we all here? */
-  release = sched_checkrelease();
-  
-  /* Release next group */
-  switch (release) {
-    case 0:
-      verbose("Adaptive: Schedule: Releasing high priority (%d)", adaptive_d.released);
-      pthread_mutex_lock(&(adaptive_d.high_l));
-      pthread_cond_broadcast(&(adaptive_d.high_n));
-      pthread_mutex_unlock(&(adaptive_d.high_l));
-      break;
-    case 1:
-      verbose("Adaptive: Schedule: Releasing med priority (%d)", adaptive_d.released);
-      pthread_mutex_lock(&(adaptive_d.med_l));
-      pthread_cond_broadcast(&(adaptive_d.med_n));
-      pthread_mutex_unlock(&(adaptive_d.med_l));
-      break;
-    case 2:
-      verbose("Adaptive: Schedule: Releasing low priority (%d)", adaptive_d.released);
-      pthread_mutex_lock(&(adaptive_d.low_l));
-      pthread_cond_broadcast(&(adaptive_d.low_n));
-      pthread_mutex_unlock(&(adaptive_d.low_l));
-      break;
-    default:
-      break;
-  }
+  removeClientpri(cid);
+  updateCutoffs();
   pthread_mutex_unlock(&(adaptive_d.lock));
-  /* Wait for my next turn, or release self if part of next group */
-  if (which != release) {
-    do {
-      switch (which) {
-        case 0:
-          pthread_mutex_lock(&(adaptive_d.high_l));
-          pthread_cond_wait(&(adaptive_d.high_n), &(adaptive_d.high_l));
-          pthread_mutex_unlock(&(adaptive_d.high_l));
-          break;
-        case 1:
-          pthread_mutex_lock(&(adaptive_d.med_l));
-          pthread_cond_wait(&(adaptive_d.med_n), &(adaptive_d.med_l));
-          pthread_mutex_unlock(&(adaptive_d.med_l));
-          break;
-        case 2:
-          pthread_mutex_lock(&(adaptive_d.low_l));
-          pthread_cond_wait(&(adaptive_d.low_n), &(adaptive_d.low_l));
-          pthread_mutex_unlock(&(adaptive_d.low_l));
-          break;
-        default:
-          break;
-      }
-    } while (which != getCurrent());
+}
+
+/* Prints per class turn waits. Read without the lock, so it never holds
+   up the scheduler. */
+static void adaptive_stats(FILE *out) {
+  static const char *names[3] = {"high", "med", "low"};
+  adp_stats *st;
+  unsigned long seen, p99;
+  int c, b;
+  for (c = 0; c < 3; ++c) {
+    st = &adaptive_d.wait[c];
+    if (st->count == 0)
+      continue;
+    for (b = 0, seen = 0; b < ADP_HIST_BUCKETS; ++b) {
+      seen += st->hist[b];
+      if (seen * 100 >= st->count * 99)
+        break;
+    }
+    p99 = b == 0 ? 0 : 1UL << b;
+    fprintf(out, "Adaptive: %s: %lu turns, mean wait %luus, p99 < %luus, max %luus\n",
+      names[c], st->count, st->total_us / st->count, p99, st->max_us);
   }
+  fprintf(out, "Adaptive: %lu promotions, %lu turns at the %ldms maximum wait, %d of %d senders busy\n",
+    adaptive_d.promoted, adaptive_d.expired, adaptive_d.max_wait_us / 1000,
+    adaptive_d.active, adaptive_d.senders);
 }
 
 static void shutdown_adaptive(void *arg) {
@@ -849,7 +2493,7 @@ void *adaptive_scheduler(void *arg) {
           return NULL;
         }
         
-        event = ALLOC(cli_evt);
+        event = POOL_GET(&cli_evt_pool, cli_evt);
         event->cid = -1;
         event->fd = cfd;
         
@@ -908,7 +2552,7 @@ void *adaptive_scheduler(void *arg) {
             if (r <= 0) {
               /* Client disconnect */
               verbose("Adaptive: Client %d disconnected.", cid);
-              efree(event);
+              mempool_put(&cli_evt_pool, event);
               clean = 1;
               pthread_mutex_lock(&(adaptive_d.lock));
               removeClientpri(cid);
@@ -955,19 +2599,104 @@ void *adaptive_scheduler(void *arg) {
   pthread_exit(NULL);
 }
 
+/**
+  Sharded Listeners
+*/
+static shard_t *shards;
+static int num_shards;
+static int next_cid = 1; /* Shared by every acceptor */
+
+static void accept_loop(shard_t *sh) {
+  int cfd, r, cid;
+  socklen_t clilen;
+  struct sockaddr_storage cli_addr;
+  char s[INET6_ADDRSTRLEN];
+  
+  clilen = sizeof(cli_addr);
+  for (;;) {
+    if ((cfd = accept(sh->sockfd, (struct sockaddr *)&cli_addr, &clilen)) < 0) {
+      perror("accept");
+      global_exit(1);
+    }
+    inet_ntop(cli_addr.ss_family, get_in_addr((struct sockaddr *)&cli_addr),
+      s, sizeof s);
+    cid = __sync_fetch_and_add(&next_cid, 1);
+    if (event_f)
+      r = evloop_add(cfd,cid,s);
+    else
+      r = executor_execute(&(sh->pool),cfd,cid,s);
+    if (r == -1) {
+      char *reason;
+      if (!event_f && errno == EBUSY && executor_turn_away(&(sh->pool), cfd, s) == 0)
+        continue;
+      if (event_f && errno != EINTR) {
+        reason = strerror(errno);
+      } else if (errno == EBUSY) {
+        reason = "Accept queue full";
+      } else {
+        reason = "Server is shutting down";
+      }
+      verbose("Client %s connection dropped: %s.", s, reason);
+      accesslog_add(s, cid, "REJECT", NULL, 0, 0);
+      close(cfd);
+      metrics_add(M_ERR_REJECTED, 1);
+    } else if (event_f) {
+      /* Executor workers count and log their own */
+      metrics_add(M_CONNECTIONS, 1);
+      accesslog_add(s, cid, "ACCEPT", NULL, 0, 0);
+    }
+  }
+  
+}
+
+static void *shard_thread(void *arg) {
+  shard_t *sh = (shard_t *)arg;
+  verbose("Shard-%d: Accepting on CPU %d.", sh->id, sh->cpu);
+  accept_loop(sh);
+  return NULL;
+}
+
 /**
   Main
 */
 static void global_exit(int status) {
+  static int exiting = 0;
+  int i;
+  if (__sync_lock_test_and_set(&exiting, 1)) {
+    /* Already tearing down, e.g. a shard whose listener was just closed */
+    pthread_exit(NULL);
+  }
   if (sockfd != -1)
     close(sockfd);
+  for (i = 1; i < num_shards; ++i)
+    close(shards[i].sockfd);
   if (adaptivefd != -1)
     close(adaptivefd);
   if (atid_v) {
     pthread_cancel(adaptive_tid);
     pthread_join(adaptive_tid, NULL);
   }
-  executor_shutdown();
+  if (cache_f)
+    cache_stats(&cache, stderr);
+  if (adaptive_f)
+    adaptive_stats(stderr);
+  if (!event_f && !uring_f)
+    for (i = 0; i < num_shards; ++i)
+      executor_stats(&(shards[i].pool), stderr);
+  if (event_f)
+    evloop_shutdown();
+  else if (uring_f)
+    uring_exit(&ring); /* SIGINT lands on the main thread, which runs the ring */
+  else
+    for (i = 0; i < num_shards; ++i)
+      executor_shutdown(&(shards[i].pool));
+  if (trace_f && trace_write() != 0)
+    perror("trace");
+  accesslog_stop();
+  if (accesslog_dropped() > 0)
+    fprintf(stderr, "Access log: %lu records dropped.\n", accesslog_dropped());
+  mem_profile_dump(stderr);
+  lockprof_dump(stderr);
   exit(status);
 }
 
@@ -988,6 +2717,142 @@ static void interrupt(int sig){
   }
 }
 
+/* SIGUSR1 only wakes the stats thread. The dumps take locks and go
+   through stdio, neither of which is safe in a handler. */
+static void dump_stats(int sig) {
+  int saved = errno;
+  char c = 1;
+  if (write(stats_pipe[1], &c, 1) == -1)
+    ; /* A dump is already pending */
+  errno = saved;
+}
+
+static void print_stats(void) {
+  int i;
+  if (cache_f)
+    cache_stats(&cache, stderr);
+  if (adaptive_f)
+    adaptive_stats(stderr);
+  if (!event_f && !uring_f)
+    for (i = 0; i < num_shards; ++i)
+      executor_stats(&(shards[i].pool), stderr);
+  mem_profile_dump(stderr);
+  lockprof_dump(stderr);
+}
+
+static void *stats_thread(void *arg) {
+  char c;
+  ssize_t r;
+  for (;;) {
+    r = read(stats_pipe[0], &c, 1);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return NULL;
+    print_stats();
+  }
+}
+
+/* Starts the thread SIGUSR1 hands stats dumps to */
+static int stats_start(void) {
+  pthread_t tid;
+  if (pipe(stats_pipe) == -1)
+    return -1;
+  fcntl(stats_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(stats_pipe[1], F_SETFD, FD_CLOEXEC);
+  fcntl(stats_pipe[1], F_SETFL, O_NONBLOCK);
+  if ((errno = pthread_create(&tid, NULL, stats_thread, NULL)) != 0)
+    return -1;
+  pthread_detach(tid);
+  return 0;
+}
+
+/* Prints the metrics, followed by the executor gauges, in the Prometheus
+   text format. Answers STATS and the metrics endpoint. */
+static void stats_print(FILE *out) {
+  threadpool_t *pool;
+  metrics_t m;
+  int i;
+  metrics_collect(&m);
+  metrics_print(out, &m);
+  fprintf(out, "# TYPE imgserver_access_log_dropped_total counter\n"
+    "imgserver_access_log_dropped_total %lu\n", accesslog_dropped());
+  if (event_f || uring_f)
+    return;
+  fprintf(out, "# TYPE imgserver_executor_queue_depth gauge\n");
+  for (i = 0; i < num_shards; ++i) {
+    pool = &(shards[i].pool);
+    fprintf(out, "imgserver_executor_queue_depth{pool=\"%d\"} %llu\n", pool->id,
+      (unsigned long long)mpmcq_length(&pool->queue));
+  }
+  fprintf(out, "# TYPE imgserver_executor_workers gauge\n");
+  for (i = 0; i < num_shards; ++i) {
+    pool = &(shards[i].pool);
+    fprintf(out, "imgserver_executor_workers{pool=\"%d\"} %d\n", pool->id,
+      __atomic_load_n(&pool->workers, __ATOMIC_RELAXED));
+  }
+  fprintf(out, "# TYPE imgserver_executor_idle_workers gauge\n");
+  for (i = 0; i < num_shards; ++i) {
+    pool = &(shards[i].pool);
+    fprintf(out, "imgserver_executor_idle_workers{pool=\"%d\"} %d\n", pool->id,
+      __atomic_load_n(&pool->idlers, __ATOMIC_RELAXED));
+  }
+}
+
+/* Listens on the loopback interface only, the metrics are not for clients */
+static int metrics_listen(int port) {
+  struct sockaddr_in addr;
+  int fd, yes = 1;
+  if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+    return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof addr) == -1 || listen(fd, 16) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Answers every connection to the metrics port with the STATS text as an
+   HTTP/1.0 response, whatever it asked for */
+static void *metrics_endpoint(void *arg) {
+  static const char header[] = "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n\r\n";
+  struct timeval tv = {1, 0};
+  char req[BUFFER_SIZE], *body;
+  size_t len, off;
+  ssize_t r;
+  FILE *f;
+  int fd;
+  for (;;) {
+    if ((fd = accept(metricsfd, NULL, NULL)) == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("metrics: accept");
+      return NULL;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    recv(fd, req, sizeof req, 0);
+    body = NULL;
+    if ((f = open_memstream(&body, &len)) != NULL) {
+      fputs(header, f);
+      stats_print(f);
+      fclose(f);
+      for (off = 0; off < len; off += r)
+        if ((r = send(fd, body + off, len - off, MSG_NOSIGNAL)) <= 0)
+          break;
+      free(body);
+    }
+    shutdown(fd, SHUT_WR);
+    close(fd);
+  }
+  return NULL;
+}
+
 #define DOC_BUFFER_LEN 160
 
 static char doc[DOC_BUFFER_LEN];
@@ -995,7 +2860,27 @@ static char args_doc[] = "PORT";
 
 static struct argp_option options[] = {
   {"adaptive",  'a', 0, 0, "Run in adaptive mode. Connecting clients must also be run in adaptive mode" },
+  {"cache-mb",  'c', "MB", 0, "Keep up to MB megabytes of hot images in memory. Statistics are printed on SIGUSR1 and at exit" },
   {"directory", 'd', "DIR", 0, "Serve images from DIR, defaults to imgs/" },
+  {"event-loop", 'e', "N", OPTION_ARG_OPTIONAL, "Serve clients from N epoll event loops instead of a thread per client, defaults to one per CPU" },
+  {"shards",    's', "N", OPTION_ARG_OPTIONAL, "Accept on N SO_REUSEPORT listeners, each with its own acceptor and workers pinned to a CPU, defaults to one per CPU" },
+  {"io-uring",  'u', 0, 0, "Serve clients from a single io_uring loop instead of a thread per client" },
+  {"rate",      'r', "BPS", 0, "Pace each client to BPS bytes per second, with SO_MAX_PACING_RATE where available" },
+  {"burst",     'b', "BYTES", 0, "Let a client paced in software send up to BYTES at once, defaults to 64KB" },
+  {"class-rates", 'R', "HIGH,MED,LOW", 0, "Pace adaptive priority classes at these rates instead, 0 keeping --rate" },
+  {"max-wait",  'm', "MS", 0, "Promote adaptive requests as they wait, serving any that waited MS milliseconds next, defaults to 100. Wait statistics are printed on SIGUSR1 and at exit" },
+  {"weights",   'w', "HIGH,MED,LOW", 0, "Share adaptive transmission between the priority classes in these proportions, defaults to 4,2,1" },
+  {"senders",   'n', "N", 0, "Let N adaptive connections transmit at once, defaults to 4" },
+  {"software-pacing", 'S', 0, 0, "Pace with token buckets and chunked sends instead of SO_MAX_PACING_RATE" },
+  {"workers",   'W', "N", 0, "Run up to N worker threads, split between the shards, defaults to 120" },
+  {"min-workers", 'M', "N", 0, "Keep N workers running however idle, split between the shards, defaults to 8. The pool grows toward --workers while connections queue and shrinks back as they go idle" },
+  {"queue",     'q', "N", 0, "Queue up to N accepted connections per shard while every worker is busy, rejecting more, defaults to 1024. Queue statistics are printed on SIGUSR1 and at exit" },
+  {"queue-wait", 'Q', "MS", 0, "Drop connections that waited in the queue longer than MS milliseconds, defaults to 5000" },
+  {"stack-kb",  'k', "KB", 0, "Give each worker a KB kilobyte stack instead of the default" },
+  {"access-log", 'l', "FILE", 0, "Append the access log to FILE instead of stderr" },
+  {"trace",     't', "FILE", 0, "Trace sampled requests through the executor and scheduler, writing Chrome trace JSON to FILE at exit" },
+  {"trace-every", 'T', "N", 0, "Sample one request in N per worker for --trace, defaults to 100" },
+  {"metrics-port", 'p', "PORT", 0, "Serve the metrics STATS answers with over HTTP on PORT of the loopback interface, for Prometheus style scrapers" },
   {"verbose",   'v', 0, 0, "Produce verbose output" },
   { 0 }
 };
@@ -1003,6 +2888,23 @@ static struct argp_option options[] = {
 struct arguments {
   int port;             /* arg1 */
   int adaptive, verbose;   /* '-a', '-v', '-m' */
+  int event_loops;      /* '-e' */
+  int uring;            /* '-u' */
+  int shards;           /* '-s' */
+  int cache_mb;         /* '-c' */
+  long long rate, burst; /* '-r', '-b' */
+  long long class_rates[3]; /* '-R' */
+  int software_pacing;  /* '-S' */
+  int weights[3], weights_set; /* '-w' */
+  int senders, senders_set; /* '-n' */
+  int max_wait;         /* '-m' */
+  int workers, min_workers; /* '-W', '-M' */
+  int queue, queue_wait, stack_kb; /* '-q', '-Q', '-k' */
+  int executor_set;
+  int metrics_port;     /* '-p', -1 for none */
+  char *access_log;     /* '-l' */
+  char *trace;          /* '-t' */
+  int trace_every;      /* '-T' */
   char *img_dir;        /* directory arg to --directory */
 };
 
@@ -1015,9 +2917,138 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
   case 'a':
     arguments->adaptive = 1;
     break;
+  case 'c':
+    errno = 0;
+    arguments->cache_mb = (int)strtol(arg,NULL,0);
+    if (errno == ERANGE || arguments->cache_mb < 0)
+      argp_usage(state);
+    break;
   case 'd':
     arguments->img_dir = arg;
     break;
+  case 'e':
+    if (arg) {
+      errno = 0;
+      arguments->event_loops = (int)strtol(arg,NULL,0);
+      if (errno == ERANGE || arguments->event_loops < 1)
+        argp_usage(state);
+    } else {
+      arguments->event_loops = (int)sysconf(_SC_NPROCESSORS_ONLN);
+      if (arguments->event_loops < 1)
+        arguments->event_loops = 1;
+    }
+    break;
+  case 's':
+    if (arg) {
+      errno = 0;
+      arguments->shards = (int)strtol(arg,NULL,0);
+      if (errno == ERANGE || arguments->shards < 1)
+        argp_usage(state);
+    } else {
+      arguments->shards = (int)sysconf(_SC_NPROCESSORS_ONLN);
+      if (arguments->shards < 1)
+        arguments->shards = 1;
+    }
+    break;
+  case 'u':
+    arguments->uring = 1;
+    break;
+  case 'r':
+    errno = 0;
+    arguments->rate = strtoll(arg,NULL,0);
+    if (errno == ERANGE || arguments->rate < 0)
+      argp_usage(state);
+    break;
+  case 'b':
+    errno = 0;
+    arguments->burst = strtoll(arg,NULL,0);
+    if (errno == ERANGE || arguments->burst < 1)
+      argp_usage(state);
+    break;
+  case 'R':
+    errno = 0;
+    if (sscanf(arg, "%lld,%lld,%lld", &arguments->class_rates[0],
+        &arguments->class_rates[1], &arguments->class_rates[2]) != 3 ||
+        arguments->class_rates[0] < 0 || arguments->class_rates[1] < 0 ||
+        arguments->class_rates[2] < 0)
+      argp_usage(state);
+    break;
+  case 'S':
+    arguments->software_pacing = 1;
+    break;
+  case 'm':
+    errno = 0;
+    arguments->max_wait = (int)strtol(arg,NULL,0);
+    if (errno == ERANGE || arguments->max_wait < 1)
+      argp_usage(state);
+    break;
+  case 'w':
+    if (sscanf(arg, "%d,%d,%d", &arguments->weights[0], &arguments->weights[1],
+        &arguments->weights[2]) != 3 || arguments->weights[0] < 1 ||
+        arguments->weights[1] < 1 || arguments->weights[2] < 1)
+      argp_usage(state);
+    arguments->weights_set = 1;
+    break;
+  case 'n':
+    errno = 0;
+    arguments->senders = (int)strtol(arg,NULL,0);
+    if (errno == ERANGE || arguments->senders < 1)
+      argp_usage(state);
+    arguments->senders_set = 1;
+    break;
+  case 'W':
+    errno = 0;
+    arguments->workers = (int)strtol(arg,NULL,0);
+    if (errno == ERANGE || arguments->workers < 1)
+      argp_usage(state);
+    arguments->executor_set = 1;
+    break;
+  case 'M':
+    errno = 0;
+    arguments->min_workers = (int)strtol(arg,NULL,0);
+    if (errno == ERANGE || arguments->min_workers < 1)
+      argp_usage(state);
+    arguments->executor_set = 1;
+    break;
+  case 'q':
+    errno = 0;
+    arguments->queue = (int)strtol(arg,NULL,0);
+    if (errno == ERANGE || arguments->queue < 1)
+      argp_usage(state);
+    arguments->executor_set = 1;
+    break;
+  case 'Q':
+    errno = 0;
+    arguments->queue_wait = (int)strtol(arg,NULL,0);
+    if (errno == ERANGE || arguments->queue_wait < 1)
+      argp_usage(state);
+    arguments->executor_set = 1;
+    break;
+  case 'k':
+    errno = 0;
+    arguments->stack_kb = (int)strtol(arg,NULL,0);
+    if (errno == ERANGE || arguments->stack_kb < PTHREAD_STACK_MIN / 1024)
+      argp_error(state, "--stack-kb must be at least %d", (int)(PTHREAD_STACK_MIN / 1024));
+    arguments->executor_set = 1;
+    break;
+  case 'l':
+    arguments->access_log = arg;
+    break;
+  case 't':
+    arguments->trace = arg;
+    break;
+  case 'T':
+    errno = 0;
+    arguments->trace_every = (int)strtol(arg,NULL,0);
+    if (errno == ERANGE || arguments->trace_every < 1)
+      argp_usage(state);
+    break;
+  case 'p':
+    errno = 0;
+    arguments->metrics_port = (int)strtol(arg,NULL,0);
+    if (errno == ERANGE || arguments->metrics_port < 0 || arguments->metrics_port > 65535)
+      argp_usage(state);
+    break;
   case 'v':
     arguments->verbose = 1;
     break;
@@ -1034,6 +3065,36 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
     }
     break;
 
+  case ARGP_KEY_END:
+    if (arguments->adaptive && arguments->event_loops)
+      argp_error(state, "--event-loop cannot be combined with --adaptive");
+    if (arguments->uring && (arguments->adaptive || arguments->event_loops))
+      argp_error(state, "--io-uring cannot be combined with --adaptive or --event-loop");
+    if (arguments->shards > 1 && (arguments->uring || arguments->event_loops))
+      argp_error(state, "--shards requires the threaded executor");
+    if (arguments->uring && arguments->software_pacing)
+      argp_error(state, "--io-uring can only be paced by the kernel");
+    if ((arguments->class_rates[0] || arguments->class_rates[1] ||
+        arguments->class_rates[2]) && !arguments->adaptive)
+      argp_error(state, "--class-rates requires --adaptive");
+    if (arguments->weights_set && !arguments->adaptive)
+      argp_error(state, "--weights requires --adaptive");
+    if (arguments->senders_set && !arguments->adaptive)
+      argp_error(state, "--senders requires --adaptive");
+    if (arguments->executor_set && (arguments->uring || arguments->event_loops))
+      argp_error(state, "--workers, --min-workers, --queue, --queue-wait and --stack-kb require the threaded executor");
+    if (arguments->trace && (arguments->uring || arguments->event_loops))
+      argp_error(state, "--trace requires the threaded executor");
+    if (arguments->trace_every && !arguments->trace)
+      argp_error(state, "--trace-every requires --trace");
+    if (arguments->min_workers > arguments->workers)
+      arguments->min_workers = arguments->workers;
+    if (arguments->min_workers < arguments->shards)
+      arguments->min_workers = arguments->shards;
+    if (arguments->workers < arguments->shards)
+      arguments->workers = arguments->shards;
+    break;
+
   default:
     return ARGP_ERR_UNKNOWN;
   }
@@ -1046,12 +3107,38 @@ int main(int argc, char **argv) {
   program_name = basename(argv[0]);
   snprintf(doc,DOC_BUFFER_LEN,"%s -- a simple or adaptive image server for COMP-535\vIf PORT is omitted, a random free port will be used.",program_name);
   struct arguments arguments;
+  FILE *access_out;
   
   /* Default values. */
   arguments.port = 0;
   arguments.img_dir = NULL;
   arguments.adaptive = 0;
   arguments.verbose = 0;
+  arguments.event_loops = 0;
+  arguments.uring = 0;
+  arguments.shards = 1;
+  arguments.cache_mb = 0;
+  arguments.rate = 0;
+  arguments.burst = PACE_BURST;
+  arguments.class_rates[0] = 0;
+  arguments.class_rates[1] = 0;
+  arguments.class_rates[2] = 0;
+  arguments.software_pacing = 0;
+  memcpy(arguments.weights, (int[3])ADP_WEIGHTS, sizeof arguments.weights);
+  arguments.weights_set = 0;
+  arguments.senders = ADP_SENDERS;
+  arguments.senders_set = 0;
+  arguments.max_wait = ADP_MAX_WAIT_MS;
+  arguments.workers = MAX_WORKERS;
+  arguments.min_workers = EXEC_MIN_WORKERS;
+  arguments.queue = EXEC_QUEUE_DEPTH;
+  arguments.queue_wait = EXEC_QUEUE_WAIT_MS;
+  arguments.stack_kb = 0;
+  arguments.executor_set = 0;
+  arguments.metrics_port = -1;
+  arguments.access_log = NULL;
+  arguments.trace = NULL;
+  arguments.trace_every = 0;
   
   argp_parse (&argp, argc, argv, 0, 0, &arguments);
   
@@ -1062,6 +3149,43 @@ int main(int argc, char **argv) {
   
   verbose_f = arguments.verbose;
   adaptive_f = arguments.adaptive;
+  event_f = arguments.event_loops > 0;
+  uring_f = arguments.uring;
+  access_out = stderr;
+  if (arguments.access_log && !(access_out = fopen(arguments.access_log, "a"))) {
+    fprintf(stderr, "%s: cannot open %s: %s\n", program_name, arguments.access_log, strerror(errno));
+    exit(1);
+  }
+  if (accesslog_start(access_out) == -1) {
+    perror("pthread_create");
+    exit(1);
+  }
+  if (arguments.trace) {
+    trace_init(arguments.trace, arguments.trace_every ? arguments.trace_every : TRACE_EVERY);
+    trace_f = 1;
+  }
+  if (imgindex_build(&images, image_dir) == -1) {
+    fprintf(stderr, "%s: cannot index %s: %s\n", program_name, image_dir, strerror(errno));
+    exit(1);
+  }
+  fprintf(stderr, "Indexed %ld images (%ld bytes) in %s.\n",
+    (long)images.count, (long)images.bytes, image_dir);
+  cache_f = arguments.cache_mb > 0;
+  pace_rate = (uint64_t)arguments.rate;
+  pace_burst = (uint64_t)arguments.burst;
+  class_rate[0] = (uint64_t)arguments.class_rates[0];
+  class_rate[1] = (uint64_t)arguments.class_rates[1];
+  class_rate[2] = (uint64_t)arguments.class_rates[2];
+  pace_f = pace_rate || class_rate[0] || class_rate[1] || class_rate[2];
+  pace_sw = arguments.software_pacing;
+  if (cache_f && cache_init(&cache, (size_t)arguments.cache_mb << 20, images.dirfd) == -1) {
+    perror("cache");
+    exit(1);
+  }
+  /* Connection state is recycled rather than freed */
+  POOL_INIT(&clientinfo_pool, clientinfo);
+  POOL_INIT(&urconn_pool, urconn);
+  POOL_INIT(&cli_evt_pool, cli_evt);
   
   sockfd = -1;
   if (adaptive_f) {
@@ -1069,29 +3193,73 @@ int main(int argc, char **argv) {
     atid_v = 0;
   }
   signal(SIGINT, interrupt);
-  executor_init();
+  if (stats_start() == -1)
+    perror("stats");
+  else
+    signal(SIGUSR1, dump_stats);
+  /* A client vanishing mid-sendfile must not take every other one with it */
+  signal(SIGPIPE, SIG_IGN);
+  if (event_f) {
+    if (evloop_init(arguments.event_loops) == -1)
+      global_exit(1);
+  }
   
-  int cfd, cid=1;
-  socklen_t clilen;
-  struct sockaddr_storage cli_addr;
-  char s[INET6_ADDRSTRLEN];
+  int i, ncpu, port;
+  pthread_attr_t attr;
   
-  sockfd = create_and_bind_sock(arguments.port);
+  sockfd = create_and_bind_sock(arguments.port, arguments.shards > 1);
   if (sockfd == -1) {
     fprintf(stderr, "%s: failed to bind\n", program_name);
     global_exit(1);
   }
-  if (listen(sockfd, 10) != 0) {
+  if (listen(sockfd, SOMAXCONN) != 0) {
     perror("listen");
     close(sockfd);
     global_exit(1);
   }
   
-  fprintf(stderr, "Listening on port %d.\n", get_port_num(sockfd));
+  port = get_port_num(sockfd);
+  fprintf(stderr, "Listening on port %d.\n", port);
+  
+  /* Unsharded servers are a single shard accepting on the main thread */
+  ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpu < 1)
+    ncpu = 1;
+  shards = (shard_t *)ecalloc(arguments.shards, sizeof(shard_t));
+  for (i = 0; i < arguments.shards; ++i) {
+    shards[i].id = i + 1;
+    if (i == 0) {
+      shards[i].sockfd = sockfd;
+    } else {
+      shards[i].sockfd = create_and_bind_sock(port, 1);
+      if (shards[i].sockfd == -1) {
+        fprintf(stderr, "%s: failed to bind shard %d\n", program_name, i + 1);
+        global_exit(1);
+      }
+      if (listen(shards[i].sockfd, SOMAXCONN) != 0) {
+        perror("listen");
+        global_exit(1);
+      }
+    }
+    shards[i].cpu = arguments.shards > 1 ? i % ncpu : -1;
+    /* The first shards take the remainder, so the pools add up to the
+       totals asked for and every shard gets at least one worker */
+    if (!event_f && !uring_f &&
+        executor_init(&(shards[i].pool), i + 1, shards[i].cpu,
+          arguments.min_workers / arguments.shards + (i < arguments.min_workers % arguments.shards),
+          arguments.workers / arguments.shards + (i < arguments.workers % arguments.shards),
+          arguments.queue, (size_t)arguments.stack_kb * 1024, arguments.queue_wait) == -1)
+      global_exit(1);
+    ++num_shards;
+  }
+  if (num_shards > 1)
+    fprintf(stderr, "Accepting on %d SO_REUSEPORT shards.\n", num_shards);
+  if (event_f)
+    fprintf(stderr, "Serving from %d event loops.\n", arguments.event_loops);
   if (adaptive_f) {
-    initialize_adaptive();
+    initialize_adaptive(arguments.weights, arguments.max_wait, arguments.senders);
     
-    adaptivefd = create_and_bind_sock(0);
+    adaptivefd = create_and_bind_sock(0, 0);
     if (adaptivefd == -1) {
       fprintf(stderr, "%s: failed to bind adaptive\n", program_name);
       global_exit(1);
@@ -1110,31 +3278,35 @@ int main(int argc, char **argv) {
     atid_v = 1;
   }
   
-  clilen = sizeof(cli_addr);
-  for (;;) {
-    if ((cfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen)) < 0) {
-      perror("accept");
-      close(sockfd);
+  if (arguments.metrics_port != -1) {
+    if ((metricsfd = metrics_listen(arguments.metrics_port)) == -1) {
+      perror("metrics");
       global_exit(1);
     }
-    inet_ntop(cli_addr.ss_family, get_in_addr((struct sockaddr *)&cli_addr),
-      s, sizeof s);
-    if (executor_execute(cfd,cid++,s) == -1) {
-      char *reason;
-      if (errno == EBUSY) {
-        reason = "Worker limit reached";
-      } else {
-        reason = "Server is shutting down";
+    fprintf(stderr, "Metrics on http://127.0.0.1:%d/metrics.\n", get_port_num(metricsfd));
+    if ((errno = pthread_create(&metrics_tid, NULL, metrics_endpoint, NULL)) != 0) {
+      perror("pthread_create");
+      global_exit(1);
+    }
+  }
+  
+  if (uring_f)
+    uring_serve();
+  
+  if (num_shards > 1) {
+    for (i = 0; i < num_shards; ++i) {
+      pthread_attr_init(&attr);
+      pin_attr(&attr, shards[i].cpu);
+      if ((errno = pthread_create(&(shards[i].tid), &attr, shard_thread, &shards[i])) != 0) {
+        perror("pthread_create");
+        global_exit(1);
       }
-      if (verbose_f)
-        fprintf(stderr, "Client %s connection dropped: %s.\n", s, reason);
-      else
-        fprintf(stderr, "[%s] Reject\n", s);
-      close(cfd);
-    } else {
-      if (!verbose_f)
-        fprintf(stderr, "[%s] Accept\n", s);
+      pthread_attr_destroy(&attr);
     }
+    for (i = 0; i < num_shards; ++i)
+      pthread_join(shards[i].tid, NULL);
+  } else {
+    accept_loop(&shards[0]);
   }
   
   global_exit(0);
@@ -1,10 +1,15 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#define _GNU_SOURCE      /* pthread_attr_setaffinity_np() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>      /* va_arg, va_start() */
 #include <string.h>
+#include <ctype.h>       /* isspace() */
+#include <unistd.h>
+#include <fcntl.h>       /* fcntl(), O_NONBLOCK */
 #include <pthread.h>
 #include <errno.h>
 #include <time.h>
@@ -13,20 +18,56 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <poll.h>
 #include <sys/stat.h>     /* stat() */
+#include <sys/sendfile.h>
+#include <sys/mman.h>     /* memfd_create() */
+#include <sys/resource.h> /* setrlimit() */
+#include <stdint.h>       /* uintptr_t */
+#include <limits.h>       /* PTHREAD_STACK_MIN */
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <signal.h>
 #include <argp.h>
 #include "memory.h"
+#include "uring.h"
+#include "cache.h"
+#include "imgindex.h"
+#include "pacing.h"
+#include "prioidx.h"
+#include "lfstack.h"
+#include "mpmcq.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include "trace.h"
 
-#define MAX_IDLE_TIME 60
 #define MAX_WORKERS 120
+#define EXEC_QUEUE_DEPTH 1024 /* Accepted connections waiting for a worker */
+#define EXEC_QUEUE_WAIT_MS 5000
+#define EXEC_MIN_WORKERS 8   /* Kept warm however idle the pool is */
+#define EXEC_TICK_MS 50       /* How often the keeper resizes the pool */
+#define EXEC_TARGET_DELAY_US 5000 /* Queueing delay the pool grows to avoid */
+#define EXEC_SHRINK_UTIL .5   /* Busy fraction below which the pool shrinks */
+#define EXEC_SHRINK_TICKS 20  /* Ticks between retiring idle workers */
+#define EXEC_SHRINK_DIV 8     /* Share of the surplus retired at a time */
+#define EXEC_UTIL_ALPHA .2    /* Weight of the latest tick in the busy fraction */
+#define EXEC_RESPAWN_TICKS 20 /* Ticks without growing after pthread_create fails */
 #define BUFFER_SIZE 256
+#define MAX_BATCH 1024
 #define ADP_BUF_SIZE 64
 #define TIMEOUT_SECS 3
 #define MAX_EVENTS 25
-#define CLI_STOR_INCR 40
+#define EVL_MAX_EVENTS 256
+#define UR_ENTRIES 4096
+#define UR_CHUNK 65536 /* Default pipe capacity */
+#define PACE_BURST 65536
+#define ADP_CHUNK 65536 /* Bytes a grant carries per unit of class weight */
+#define ADP_WEIGHTS {4, 2, 1} /* DRR weights of the high, med and low classes */
+#define ADP_SENDERS 4       /* Connections holding a grant at once */
+#define ADP_SEND_TIMEOUT_MS 10000 /* Longest a full socket may stall, then the client is dropped */
+#define ADP_MAX_WAIT_MS 100 /* Longest a queued chunk waits for its turn */
+#define ADP_AGE_STEPS 3     /* Promotions spread over the maximum wait */
+#define ADP_HIST_BUCKETS 32 /* log2 microsecond wait histogram */
 #define HIGH_PRI_PCT .2
 #define MED_PRI_PCT .3
 /* LOW_PRI_PCT .5 */
@@ -37,81 +78,208 @@ typedef struct _threadpool threadpool_t;
 struct _threadpool_task;
 typedef struct _threadpool_task threadpool_task_t;
 
+/* An accepted connection waiting for a worker */
+typedef struct _queued_conn {
+  int socketfd;
+  int cid;
+  char addr[INET6_ADDRSTRLEN];
+  struct timespec since;
+} queued_conn;
+
 struct _threadpool {
+  int id;
+  int cpu;         /* Workers are pinned here, -1 for no affinity */
+  int min_workers;
+  int max_workers;
   int count;
-  int workers;
-  threadpool_task_t *cached;
-  threadpool_task_t *stopped;
-  pthread_mutex_t lock;
+  int workers;     /* Live threads */
+  int idlers;      /* Workers waiting on pool->idle */
+  threadpool_task_t **tasks; /* One per worker, reused when it exits */
+  lfstack_t idle;  /* Slots of workers waiting for a socket */
+  lfstack_t free;  /* Slots without a live worker */
+  mpmcq_t queue;   /* Connections accepted while every worker was busy */
+  mpmcq_t turned_away; /* Rejected connections for the reaper to close */
+  pthread_t keeper;    /* Sizes the pool and reaps off the accept path */
+  int chores;      /* Futex the keeper sleeps on, bumped to wake it */
+  size_t stack_size;   /* 0 for the default */
+  long queue_wait_ns;  /* Connections queued longer are dropped */
+  unsigned long queued, dropped, rejected;
+  long max_queued_us;
+  unsigned long delay_sum_us, delay_count; /* Queueing since the last tick */
+  long delay_us;   /* Mean queueing delay over the last tick */
+  double util;     /* Smoothed fraction of workers busy */
+  int calm, hold;  /* Ticks spent shrinkable, ticks left not growing */
+  int peak;
+  unsigned long grown, shrunk, grow_events;
+  pthread_mutex_t lock;  /* Only for waiting on workers at shutdown */
   pthread_cond_t notify;
   int shutdown;
   int running;
 };
 
+/* A worker's state, changed by compare and swap so that dispatch, idle
+   expiry and shutdown each either win an idle worker or leave it be */
+#define TASK_BUSY 0  /* Serving socketfd, or about to dequeue when it is -1 */
+#define TASK_IDLE 1  /* On pool->idle waiting for a socket or a queued one */
+#define TASK_GONE 2  /* Exiting, for the keeper to join */
+#define TASK_EMPTY 3 /* No thread */
+
 struct _threadpool_task {
+  threadpool_t *pool;
   pthread_t tid;
   int id;
+  int slot;
+  int state;       /* TASK_*, idle workers sleep on it as a futex */
   int cid;
   char addr[INET6_ADDRSTRLEN];
   int socketfd;
-  int cached;
-  int stopped;
-  pthread_mutex_t lock;  /* Mostly for notification purposes */
-  pthread_cond_t notify; /* Threads should not conflict here */
-  threadpool_task_t *prev; /* These fields are protected by  */
-  threadpool_task_t *next; /* the main pool lock not t->lock */
 };
 
+/* Event loop connection states */
+#define CI_READ 0     /* Waiting for a complete request line */
+#define CI_HEADER 1   /* Flushing out[] (HELLO, FILE or ERROR line) */
+#define CI_SENDFILE 2 /* Transmitting file body */
+#define CI_SENDBUF 3  /* Transmitting cached body */
+
+#define ADP_IDLE 0
+#define ADP_QUEUED 1
+#define ADP_GRANTED 2
+
+/* A connection waiting for, or holding, a grant to send in adaptive mode */
+typedef struct _adp_waiter {
+  int state;
+  int class;       /* Queue it is in, raised by aging */
+  int origin;      /* Class it was sorted into */
+  long quantum;    /* Bytes left of the grant */
+  int charged;     /* The grant came out of its class's credit */
+  struct timespec since;
+  pthread_cond_t turn;
+  struct _adp_waiter *next;
+} adp_waiter;
+
 typedef struct _clientinfo {
-  threadpool_task_t *parent;
+  threadpool_task_t *parent; /* NULL when owned by an event loop */
+  int socketfd;
+  int cid;
+  char addr[INET6_ADDRSTRLEN];
+  int state;
   char buffer[BUFFER_SIZE];
-  size_t name_len;
-  char *filename;
-  FILE *file;
+  size_t used;     /* Unparsed bytes in buffer */
+  int overlong;    /* Dropping the rest of a line too long for buffer */
+  int batch;       /* Request lines left in the current BATCH */
+  int batched;     /* Current request is part of a BATCH */
+  int inband;      /* Registered with the scheduler through SPEED lines */
+  int ranged;      /* Current request is a RANGE */
+  off_t range_off;
+  size_t range_len; /* 0 for up to the end of the file */
+  int conditional; /* Current request is an IF */
+  char ifval[VALIDATOR_LEN];     /* Validator the client holds */
+  char validator[VALIDATOR_LEN]; /* Of the file being sent, "-" unless asked for */
+  uint64_t kernel_rate; /* SO_MAX_PACING_RATE in effect, 0 for none */
+  uint64_t pace_rate;   /* Software pacing through pace, 0 for none */
+  tbucket_t pace;
+  int is_deferred;      /* On the event loop's deferred list */
+  struct timespec wake;
+  struct _clientinfo *next_deferred;
+  adp_waiter turn;      /* Adaptive mode only */
+  char out[BUFFER_SIZE];
+  size_t out_len;
+  size_t out_sent;
+  img_entry *img;
+  cache_entry *entry; /* Set instead of filefd when served from the cache */
   int filefd;
   struct stat st;
   size_t remain;
   off_t offset;
+  uint64_t opened;  /* Connection accepted, metrics_now_ns() */
+  uint64_t started; /* Request line framed, 0 once logged */
+  size_t sent;      /* Body bytes of the current request */
+  char request[ACCESS_TEXT_LEN];
+  int traced;           /* Current request is sampled for --trace */
+  uint64_t cpu_started; /* Thread CPU time when it started */
 } clientinfo;
 
-typedef struct _clientpri {
-  int cid;
-  int speed;
-} clientpri;
+/* io_uring completion tags, packed into the low bits of user_data */
+#define UR_ACCEPT 0
+#define UR_RECV 1
+#define UR_SEND 2
+#define UR_OPEN 3
+#define UR_SPLICE_IN 4
+#define UR_SPLICE_OUT 5
+#define UR_CLOSE 6
+#define UR_SENDBUF 7
+#define UR_STATX 8
+#define UR_TAG_MASK 15 /* urconn comes from a pool, MEM_ALIGN aligned */
+
+typedef struct _urconn {
+  clientinfo ci;
+  int pipefd[2];    /* File data is spliced file -> pipe -> socket */
+  size_t piped;     /* Bytes sitting in the pipe */
+  int inflight;     /* SQEs not yet completed, uc is freed at 0 */
+  int failed;
+  uint64_t started; /* Of the openat, statx or splice in flight, for metrics */
+  struct statx stx;
+} urconn;
+
+typedef struct _adp_stats {
+  unsigned long count;
+  unsigned long total_us;
+  unsigned long max_us;
+  unsigned long hist[ADP_HIST_BUCKETS];
+} adp_stats;
 
 typedef struct _prioritylocks {
-  clientpri *clients;
-  int num_clients;
-  int capacity;
+  prioidx_t clients; /* By speed, slowest (highest priority) first */
   pthread_mutex_t lock;
   int high_t;
   int med_t;
-  int released;
-  int next; /* 0 high, 1 med, 2 low */
-  int current;
-  int high_c;
-  pthread_mutex_t high_l;
-  pthread_cond_t high_n;
-  int med_c;
-  pthread_mutex_t med_l;
-  pthread_cond_t med_n;
-  int low_c;
-  pthread_mutex_t low_l;
-  pthread_cond_t low_n;
+  adp_waiter *head[3]; /* Per class FIFO, 0 high, 1 med, 2 low */
+  adp_waiter *tail[3];
+  long deficit[3];     /* DRR credit in bytes, may go negative */
+  int weight[3];
+  int turn;            /* Class holding the DRR turn */
+  int active;          /* Waiters holding a grant */
+  int senders;         /* Most grants held at once */
+  long max_wait_us;
+  adp_stats wait[3];   /* By the class waiters were sorted into */
+  unsigned long promoted;
+  unsigned long expired; /* Served out of turn at the maximum wait */
 } prioritylocks;
 
+typedef struct _evloop {
+  pthread_t tid;
+  int id;
+  int epollfd;
+  struct _clientinfo *deferred; /* Paced connections waiting for tokens */
+} evloop_t;
+
+typedef struct _shard {
+  pthread_t tid;
+  int id;
+  int cpu;
+  int sockfd;
+  threadpool_t pool;
+} shard_t;
+
 typedef struct _cli_evt {
   int cid;
   int fd;
 } cli_evt;
 
-int executor_init();
-int executor_execute(int socketfd, int cid, char *addr);
-void executor_shutdown();
-void executor_thread_shutdown(threadpool_task_t *t);
+int executor_init(threadpool_t *pool, int id, int cpu, int min_workers,
+  int max_workers, int queue_depth, size_t stack_size, int queue_wait_ms);
+int executor_execute(threadpool_t *pool, int socketfd, int cid, char *addr);
+int executor_turn_away(threadpool_t *pool, int socketfd, char *addr);
+void executor_shutdown(threadpool_t *pool);
+void executor_thread_exit(threadpool_task_t *t);
 void executor_thread_done(threadpool_task_t *t);
-int executor_thread_expire(threadpool_task_t *t);
-void executor_garbage_collect();
+void executor_reap(threadpool_task_t *t);
+void executor_stats(threadpool_t *pool, FILE *out);
 void *executor_thread(void *task);
 
+int evloop_init(int n);
+int evloop_add(int socketfd, int cid, char *addr);
+void evloop_shutdown();
+void *evloop_thread(void *arg);
+
 #endif
@@ -0,0 +1,54 @@
+#include "slots.h"
+
+static pthread_mutex_t key_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Exiting threads leave their record for the next one to claim */
+static void slot_release(void *arg) {
+  slot_t *s = (slot_t *)arg;
+  *s->self = NULL;
+  __atomic_store_n(&s->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void slot_key_init(slot_registry *reg) {
+  pthread_mutex_lock(&key_lock);
+  if (!reg->keyed) {
+    pthread_key_create(&reg->key, slot_release);
+    reg->keyed = 1;
+  }
+  pthread_mutex_unlock(&key_lock);
+}
+
+/* Claims an unowned record of reg for the calling thread, or makes a
+   zeroed one, and caches it in *self, a thread local of the caller */
+slot_t *slot_claim(slot_registry *reg, slot_t **self) {
+  slot_t *s;
+  char *raw;
+  int unowned;
+  slot_key_init(reg);
+  for (s = __atomic_load_n(&reg->head, __ATOMIC_ACQUIRE); s; s = s->next) {
+    unowned = 0;
+    if (__atomic_compare_exchange_n(&s->owned, &unowned, 1, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+  if (!s) {
+    /* Never freed, so the slack in front of the aligned record is too */
+    raw = (char *)emalloc(reg->size + reg->align);
+    s = (slot_t *)(((uintptr_t)raw + reg->align - 1) & ~(uintptr_t)(reg->align - 1));
+    memset(s, 0, reg->size);
+    s->owned = 1;
+    s->next = __atomic_load_n(&reg->head, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&reg->head, &s->next, s, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+  s->self = self;
+  pthread_setspecific(reg->key, s);
+  *self = s;
+  return s;
+}
+
+/* The newest record of reg; the rest follow through next */
+slot_t *slot_first(slot_registry *reg) {
+  return __atomic_load_n(&reg->head, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,32 @@
+#ifndef SLOTS_H
+#define SLOTS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "memory.h"
+
+/* Heads each per-thread record kept in a registry */
+typedef struct _slot {
+  int owned;
+  struct _slot **self; /* The owner's cached pointer, cleared on release */
+  struct _slot *next;
+} slot_t;
+
+/* Records of one kind, one per live thread. Records are never freed:
+   exiting threads leave theirs, and what it holds, for the next thread to
+   claim, so walks need no lock and totals never drop. */
+typedef struct _slot_registry {
+  slot_t *head;   /* Every record ever made, pushed at the head */
+  size_t size;    /* Of a record, slot_t first */
+  size_t align;   /* A power of two */
+  int keyed;
+  pthread_key_t key;
+} slot_registry;
+
+#define SLOT_REGISTRY_INIT(type, align) { NULL, sizeof(type), (align), 0 }
+
+slot_t *slot_claim(slot_registry *reg, slot_t **self);
+slot_t *slot_first(slot_registry *reg);
+
+#endif
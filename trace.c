@@ -0,0 +1,98 @@
+#include "trace.h"
+
+static const char *trace_path;
+static int trace_every;
+static trace_event *events;
+static uint64_t used;     /* Slots handed out, may pass TRACE_MAX_EVENTS */
+static __thread unsigned seen; /* Requests this thread asked to sample */
+
+/* Allocates room for the spans, written out by trace_write() to path.
+   One request in every is sampled. */
+void trace_init(const char *path, int every) {
+  trace_path = path;
+  trace_every = every > 0 ? every : 1;
+  events = ALLOC_N(trace_event, TRACE_MAX_EVENTS);
+}
+
+/* Whether the calling thread's next request is traced. Each thread counts
+   on its own, so sampling costs no shared writes. */
+int trace_sample(void) {
+  return seen++ % trace_every == 0;
+}
+
+/* Records a span, returning it so the caller can fill in the optional
+   fields, or NULL once the buffer is full */
+trace_event *trace_span(const char *name, int pid, int tid, int cid,
+    uint64_t start_ns, uint64_t end_ns) {
+  uint64_t i = __atomic_fetch_add(&used, 1, __ATOMIC_RELAXED);
+  trace_event *e;
+  if (i >= TRACE_MAX_EVENTS)
+    return NULL;
+  e = &events[i];
+  e->name = name;
+  e->file = NULL;
+  e->start_ns = start_ns;
+  e->end_ns = end_ns;
+  e->pid = pid;
+  e->tid = tid;
+  e->cid = cid;
+  e->class = -1;
+  e->bytes = -1;
+  e->cpu_us = -1;
+  return e;
+}
+
+uint64_t trace_cpu_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void json_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\')
+      fprintf(out, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      fprintf(out, "\\u%04x", *s);
+    else
+      fputc(*s, out);
+  }
+  fputc('"', out);
+}
+
+/* Writes the spans as Chrome trace JSON, which chrome://tracing and
+   Perfetto load. Call once every traced thread is done. */
+int trace_write(void) {
+  static const char *classes[3] = {"high", "med", "low"};
+  uint64_t i, n = used < TRACE_MAX_EVENTS ? used : TRACE_MAX_EVENTS;
+  trace_event *e;
+  FILE *out;
+  if (!(out = fopen(trace_path, "w")))
+    return -1;
+  fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for (i = 0; i < n; ++i) {
+    e = &events[i];
+    fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+      "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"cid\":%d", i ? ",\n" : "",
+      e->name, e->pid, e->tid, e->start_ns / 1e3,
+      (e->end_ns > e->start_ns ? e->end_ns - e->start_ns : 0) / 1e3, e->cid);
+    if (e->file) {
+      fprintf(out, ",\"file\":");
+      json_string(out, e->file);
+    }
+    if (e->class >= 0 && e->class < 3)
+      fprintf(out, ",\"class\":\"%s\"", classes[e->class]);
+    if (e->bytes >= 0)
+      fprintf(out, ",\"bytes\":%ld", e->bytes);
+    if (e->cpu_us >= 0)
+      fprintf(out, ",\"cpu_us\":%ld", e->cpu_us);
+    fprintf(out, "}}");
+  }
+  fprintf(out, "\n]}\n");
+  if (used > TRACE_MAX_EVENTS)
+    fprintf(stderr, "Trace: %llu spans dropped with the buffer full.\n",
+      (unsigned long long)(used - TRACE_MAX_EVENTS));
+  fprintf(stderr, "Trace: %llu spans written to %s.\n", (unsigned long long)n, trace_path);
+  return fclose(out);
+}
@@ -0,0 +1,35 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include "memory.h"
+
+#define TRACE_MAX_EVENTS (1 << 18) /* Later spans are dropped */
+#define TRACE_EVERY 100 /* Default sampling, one request in this many */
+
+/* A complete span of one traced request. Optional fields are -1, or NULL
+   for file, when they do not apply. */
+typedef struct _trace_event {
+  const char *name;
+  const char *file;
+  uint64_t start_ns;  /* CLOCK_MONOTONIC */
+  uint64_t end_ns;
+  int pid;            /* Executor pool */
+  int tid;            /* Worker within the pool */
+  int cid;
+  int class;          /* Adaptive class */
+  long bytes;
+  long cpu_us;        /* Thread CPU time spent on the request */
+} trace_event;
+
+void trace_init(const char *path, int every);
+int trace_sample(void);
+trace_event *trace_span(const char *name, int pid, int tid, int cid,
+  uint64_t start_ns, uint64_t end_ns);
+uint64_t trace_cpu_ns(void);
+int trace_write(void);
+
+#endif
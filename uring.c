@@ -0,0 +1,138 @@
+#include "uring.h"
+
+int uring_init(uring_t *ring, unsigned entries) {
+  struct io_uring_params p;
+  memset(ring, 0, sizeof(uring_t));
+  memset(&p, 0, sizeof p);
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd == -1)
+    return -1;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    /* Every kernel with multishot accept has this */
+    close(ring->fd);
+    ring->fd = -1;
+    return -1;
+  }
+  ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (ring->cq_size > ring->sq_size)
+    ring->sq_size = ring->cq_size;
+  ring->cq_size = ring->sq_size;
+  ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) {
+    close(ring->fd);
+    memset(ring, 0, sizeof(uring_t));
+    return -1;
+  }
+  ring->cq_ptr = ring->sq_ptr;
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size,
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+    memset(ring, 0, sizeof(uring_t));
+    return -1;
+  }
+  ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+  ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+  ring->sq_flags = (unsigned *)((char *)ring->sq_ptr + p.sq_off.flags);
+  ring->sq_entries = p.sq_entries;
+  ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+  ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+  return 0;
+}
+
+/* Tears the ring down; does nothing if it was never set up */
+void uring_exit(uring_t *ring) {
+  if (ring->sq_ptr == NULL)
+    return;
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->sq_ptr, ring->sq_size);
+  close(ring->fd);
+  memset(ring, 0, sizeof(uring_t));
+}
+
+/* Returns a zeroed SQE, flushing queued ones to the kernel first if the
+   submission ring is full. Only NULL, with errno set, if the kernel did
+   not take them; EBUSY means it may once completions are reaped. */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+  struct io_uring_sqe *sqe;
+  unsigned head, tail, idx;
+  head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  tail = *ring->sq_tail + ring->sq_queued;
+  if (tail - head >= ring->sq_entries) {
+    if (uring_submit(ring, 0) == -1)
+      return NULL;
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    tail = *ring->sq_tail;
+    if (tail - head >= ring->sq_entries) {
+      errno = EBUSY;
+      return NULL;
+    }
+  }
+  idx = tail & *ring->sq_mask;
+  sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sq_array[idx] = idx;
+  ++ring->sq_queued;
+  return sqe;
+}
+
+/* Publishes queued SQEs and enters the kernel, waiting for at least
+   wait_nr completions. SQEs the kernel did not take stay in the ring and
+   are offered again until it takes them all or makes no progress. Parked
+   completions are flushed into the CQ ring on the way. */
+int uring_submit(uring_t *ring, unsigned wait_nr) {
+  unsigned tail = *ring->sq_tail + ring->sq_queued, submit, flags;
+  int r, total = 0;
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+  ring->sq_queued = 0;
+  for (;;) {
+    submit = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    flags = wait_nr || (__atomic_load_n(ring->sq_flags, __ATOMIC_ACQUIRE) &
+      IORING_SQ_CQ_OVERFLOW) ? IORING_ENTER_GETEVENTS : 0;
+    r = (int)syscall(__NR_io_uring_enter, ring->fd, submit, wait_nr, flags,
+      NULL, 0);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r == -1)
+      return -1;
+    total += r;
+    if ((unsigned)r >= submit)
+      return total;
+    if (r == 0) {
+      errno = EBUSY;
+      return -1;
+    }
+  }
+}
+
+/* Moves completions the kernel parked while the CQ ring was full back
+   into it. Returns 1 if there were any, 0 if not, -1 with errno set. */
+int uring_flush(uring_t *ring) {
+  int r;
+  if (!(__atomic_load_n(ring->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW))
+    return 0;
+  do {
+    r = (int)syscall(__NR_io_uring_enter, ring->fd, 0, 0,
+      IORING_ENTER_GETEVENTS, NULL, 0);
+  } while (r == -1 && errno == EINTR);
+  return r == -1 ? -1 : 1;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,43 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Minimal io_uring wrapper over the raw syscalls, enough for the server's
+   io_uring backend without depending on liburing. */
+typedef struct _uring {
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *sq_flags; /* IORING_SQ_CQ_OVERFLOW when completions were parked */
+  unsigned sq_entries;
+  unsigned sq_queued; /* SQEs filled in but not yet submitted */
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr;
+  size_t sq_size;
+  void *cq_ptr;
+  size_t cq_size;
+  size_t sqes_size;
+} uring_t;
+
+int uring_init(uring_t *ring, unsigned entries);
+void uring_exit(uring_t *ring);
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+int uring_submit(uring_t *ring, unsigned wait_nr);
+int uring_flush(uring_t *ring);
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+
+#endif